@@ -0,0 +1,205 @@
+#include "BinaryInstructions.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const char BINARY_MAGIC[8] = {'M', 'A', 'P', 'O', 'P', 'S', '0', '2'};
+
+// Written in place of a malformed line when converting back to text
+const char MALFORMED_LINE_TEXT[] = "?";
+
+bool isBinaryInstructions(const char* data, size_t length) {
+    return length >= sizeof(BINARY_MAGIC) && memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+}
+
+bool openBinaryInstructions(const char* data, size_t length, binary_instructions_t* instructions) {
+    if (!isBinaryInstructions(data, length) || length < sizeof(binary_header_t)) return false;
+
+    binary_header_t header;
+    memcpy(&header, data, sizeof(header));
+    size_t available = length - sizeof(header);
+    // Each section is checked against what is left before its size is taken, so huge counts
+    // can't overflow
+    if (header.numOpps > available / sizeof(binary_opp_t)) return false;
+    available -= header.numOpps * sizeof(binary_opp_t);
+    uint64_t numBlocks = (header.numOpps + BINARY_BLOCK_OPPS - 1) / BINARY_BLOCK_OPPS;
+    if (numBlocks > available / sizeof(uint64_t)) return false;
+    available -= numBlocks * sizeof(uint64_t);
+    if (header.numInserts > available / sizeof(uint32_t)) return false;
+    available -= header.numInserts * sizeof(uint32_t);
+    if (header.heapBytes != available) return false;
+
+    instructions->numThreads = header.numThreads;
+    instructions->numOpps = header.numOpps;
+    instructions->opps = data + sizeof(header);
+    instructions->insertCounts = instructions->opps + header.numOpps * sizeof(binary_opp_t);
+    instructions->numInserts = header.numInserts;
+    instructions->valueOffsets = instructions->insertCounts + numBlocks * sizeof(uint64_t);
+    instructions->heap = instructions->valueOffsets + header.numInserts * sizeof(uint32_t);
+    instructions->heapBytes = header.heapBytes;
+    return true;
+}
+
+bool isBinaryInsert(binary_instructions_t* instructions, uint64_t index) {
+    return index < instructions->numOpps &&
+           instructions->opps[index * sizeof(binary_opp_t)] == INSERT;
+}
+
+// Returns the number of inserts before record index, from the count before its block
+uint64_t insertsBefore(binary_instructions_t* instructions, uint64_t index) {
+    uint64_t block = index / BINARY_BLOCK_OPPS;
+    uint64_t numInserts;
+    memcpy(&numInserts, instructions->insertCounts + block * sizeof(numInserts),
+           sizeof(numInserts));
+    for (uint64_t i = block * BINARY_BLOCK_OPPS; i < index; i++) {
+        if (isBinaryInsert(instructions, i)) numInserts++;
+    }
+    return numInserts;
+}
+
+void decodeOperation(binary_instructions_t* instructions, uint64_t index, uint64_t insertIndex,
+                     operation_t* opp) {
+    int lineNumber = index + FIRST_INSTRUCTION_LINE;
+    if (index >= instructions->numOpps) {
+        setInvalid(opp, lineNumber);
+        return;
+    }
+
+    // Records aren't aligned in memory, so they are copied out
+    binary_opp_t record;
+    memcpy(&record, instructions->opps + index * sizeof(binary_opp_t), sizeof(record));
+
+    opp->type = (operation_type_t)record.type;
+    opp->key = record.key;
+    opp->value = nullptr;
+    opp->valueLength = 0;
+
+    if (opp->type == INSERT) {
+        if (insertIndex >= instructions->numInserts) {
+            setInvalid(opp, lineNumber);
+            return;
+        }
+        uint32_t valueOffset;
+        memcpy(&valueOffset, instructions->valueOffsets + insertIndex * sizeof(valueOffset),
+               sizeof(valueOffset));
+
+        uint32_t length;
+        uint64_t offset = valueOffset;
+        if (instructions->heapBytes < sizeof(length) ||
+            offset > instructions->heapBytes - sizeof(length)) {
+            setInvalid(opp, lineNumber);
+            return;
+        }
+        memcpy(&length, instructions->heap + offset, sizeof(length));
+        offset += sizeof(length);
+        if (length > instructions->heapBytes - offset) {
+            setInvalid(opp, lineNumber);
+            return;
+        }
+        opp->value = instructions->heap + offset;
+        opp->valueLength = length;
+    } else if (opp->type != LOOKUP && opp->type != DELETE && opp->type != THREADS &&
+               opp->type != INVALID) {
+        setInvalid(opp, lineNumber);
+    }
+}
+
+void decodeOperation(binary_instructions_t* instructions, uint64_t index, operation_t* opp) {
+    uint64_t insertIndex = index < instructions->numOpps ? insertsBefore(instructions, index) : 0;
+    decodeOperation(instructions, index, insertIndex, opp);
+}
+
+void decodeOperations(binary_instructions_t* instructions, uint64_t first, uint64_t count,
+                      operation_t* opps) {
+    uint64_t insertIndex = first < instructions->numOpps ? insertsBefore(instructions, first) : 0;
+    for (uint64_t i = 0; i < count; i++) {
+        decodeOperation(instructions, first + i, insertIndex, &opps[i]);
+        if (isBinaryInsert(instructions, first + i)) insertIndex++;
+    }
+}
+
+bool convertTextToBinary(istream* input, ostream* output) {
+    binary_header_t header = {};
+    memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+
+    string line;
+    getline(*input, line);
+    int numThreads = parseThreadCount(line.data(), line.length());
+    header.numThreads = numThreads < 1 ? 0 : numThreads;
+
+    vector<binary_opp_t> records;
+    vector<uint64_t> insertCounts;
+    vector<uint32_t> valueOffsets;
+    vector<char> heap;
+    // Heap offset of each distinct value
+    unordered_map<string, uint32_t> heapOffsets;
+
+    int lineNumber = 1;
+    while (getline(*input, line)) {
+        lineNumber++;
+        if (line.empty()) continue;
+
+        operation_t opp;
+        if (!parse(line.data(), line.length(), &opp)) setInvalid(&opp, lineNumber);
+
+        if (records.size() % BINARY_BLOCK_OPPS == 0) insertCounts.push_back(valueOffsets.size());
+        binary_opp_t record;
+        record.type = opp.type;
+        record.key = opp.key;
+        if (opp.type == INSERT) {
+            string value(opp.value, opp.valueLength);
+            unordered_map<string, uint32_t>::iterator found = heapOffsets.find(value);
+            if (found != heapOffsets.end()) {
+                valueOffsets.push_back(found->second);
+            } else {
+                if (heap.size() + sizeof(uint32_t) + value.length() > UINT32_MAX) return false;
+                valueOffsets.push_back(heap.size());
+                heapOffsets[value] = heap.size();
+
+                uint32_t length = value.length();
+                heap.insert(heap.end(), (char*)&length, (char*)&length + sizeof(length));
+                heap.insert(heap.end(), value.begin(), value.end());
+            }
+        }
+        records.push_back(record);
+    }
+
+    header.numOpps = records.size();
+    header.numInserts = valueOffsets.size();
+    header.heapBytes = heap.size();
+    output->write((const char*)&header, sizeof(header));
+    output->write((const char*)records.data(), records.size() * sizeof(binary_opp_t));
+    output->write((const char*)insertCounts.data(), insertCounts.size() * sizeof(uint64_t));
+    output->write((const char*)valueOffsets.data(), valueOffsets.size() * sizeof(uint32_t));
+    output->write(heap.data(), heap.size());
+    return true;
+}
+
+void convertBinaryToText(binary_instructions_t* instructions, ostream* output) {
+    if (instructions->numThreads < 1) {
+        *output << MALFORMED_LINE_TEXT << "\n";
+    } else {
+        *output << "N " << instructions->numThreads << "\n";
+    }
+
+    for (uint64_t i = 0; i < instructions->numOpps; i++) {
+        operation_t opp;
+        decodeOperation(instructions, i, &opp);
+
+        if (opp.type == INSERT) {
+            *output << "I " << opp.key << " \"";
+            output->write(opp.value, opp.valueLength);
+            *output << "\"\n";
+        } else if (opp.type == LOOKUP) {
+            *output << "L " << opp.key << "\n";
+        } else if (opp.type == DELETE) {
+            *output << "D " << opp.key << "\n";
+        } else if (opp.type == THREADS) {
+            *output << "N " << opp.key << "\n";
+        } else {
+            *output << MALFORMED_LINE_TEXT << "\n";
+        }
+    }
+}
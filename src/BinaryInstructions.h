@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+#include "Operation.h"
+
+using namespace std;
+
+// A binary instruction file is a binary_header_t, numOpps binary_opp_t records, an 8 byte count of
+// the inserts before every BINARY_BLOCK_OPPS records, a 4 byte heap offset for each insert's value
+// in order, and a heap of values. Each value in the heap is a 4 byte length followed by its bytes.
+// Numbers are in the byte order of the machine that wrote the file.
+extern const char BINARY_MAGIC[8];
+
+// Records per insert count, so finding an insert's value reads at most this many records
+const uint64_t BINARY_BLOCK_OPPS = 64;
+
+struct binary_header_t {
+    char magic[8];
+
+    // Thread count, or 0 if the text file's thread count line was malformed
+    uint32_t numThreads;
+
+    uint32_t reserved;
+
+    uint64_t numOpps;
+
+    uint64_t numInserts;
+
+    uint64_t heapBytes;
+};
+
+// Fixed-width instruction, so instruction N is found without reading the ones before it. Only
+// inserts have a value, so its offset is kept apart instead of in every record.
+struct __attribute__((packed)) binary_opp_t {
+    // An operation_type_t
+    uint8_t type;
+
+    // Map key, or the text line number of a malformed line
+    int32_t key;
+};
+
+static_assert(sizeof(binary_header_t) == 40, "binary header must match the file layout");
+static_assert(sizeof(binary_opp_t) == 5, "binary instruction must match the file layout");
+
+// Binary instructions in memory
+struct binary_instructions_t {
+    int numThreads;
+
+    uint64_t numOpps;
+
+    const char* opps;
+
+    const char* insertCounts;
+
+    uint64_t numInserts;
+
+    const char* valueOffsets;
+
+    const char* heap;
+
+    uint64_t heapBytes;
+};
+
+// Returns true if data starts like a binary instruction file
+bool isBinaryInstructions(const char* data, size_t length);
+
+// Points instructions into length bytes of a binary instruction file.
+// Returns false if the file is too short for the counts in its header.
+bool openBinaryInstructions(const char* data, size_t length, binary_instructions_t* instructions);
+
+// Decodes instruction index into opp. Inserts point at their value in the heap. An instruction
+// that is out of range or points outside the heap is decoded as a malformed line.
+void decodeOperation(binary_instructions_t* instructions, uint64_t index, operation_t* opp);
+
+// Decodes instruction index, which has insertIndex inserts before it, into opp. Callers taking the
+// instructions in order count the inserts with isBinaryInsert instead of having them counted again.
+void decodeOperation(binary_instructions_t* instructions, uint64_t index, uint64_t insertIndex,
+                     operation_t* opp);
+
+// Returns true if instruction index is an insert, so it takes the next value
+bool isBinaryInsert(binary_instructions_t* instructions, uint64_t index);
+
+// Decodes count instructions starting at first into opps, finding the first insert's value once
+// instead of for every insert
+void decodeOperations(binary_instructions_t* instructions, uint64_t first, uint64_t count,
+                      operation_t* opps);
+
+// Converts a text instruction file to binary. Blank lines are dropped, malformed lines keep their
+// line number, and repeated values are stored once. Returns false if the heap would pass 4 GB.
+bool convertTextToBinary(istream* input, ostream* output);
+
+// Converts binary instructions to text. Malformed lines can't be recovered, so each is written as
+// a line that fails to parse.
+void convertBinaryToText(binary_instructions_t* instructions, ostream* output);
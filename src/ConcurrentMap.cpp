@@ -1,63 +1,245 @@
 #include "ConcurrentMap.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "Epoch.h"
 #include "Semaphore.h"
+#include "Topology.h"
+
+// Times an unlocked lookup retries after a writer interrupts it before it takes the lock
+const int MAX_UNLOCKED_LOOKUP_TRIES = 8;
 
-ConcurrentMap::ConcurrentMap(int numBuckets, int oppPaddingCycles) : Map(numBuckets) {
+ConcurrentMap::ConcurrentMap(int numBuckets, int oppPaddingCycles, map_backend_t backend,
+                             lock_strategy_t lockStrategy, int numStripes,
+                             hash_policy_t hashPolicy, int numShards) {
     this->numCyclesToSleepPerOpp = oppPaddingCycles;
-    sems = new sem_t[numBuckets];
+    this->hashPolicy = hashPolicy;
+    numSegments = hashPolicy == MIX_HASH ? roundUpToPowerOfTwo(numBuckets) : numBuckets;
+    segmentShift = 32;
+    while ((1 << (32 - segmentShift)) < numSegments) segmentShift--;
+    segments = new MapBackend*[numSegments];
+    locks = new StripedLock(numStripes == 0 ? numSegments : numStripes, lockStrategy);
+    unlockedLookups = lockStrategy == OPTIMISTIC_LOCK;
+    // Modulo segments hold keys from every partition, so they are not sharded
+    this->numShards = hashPolicy == MIX_HASH ? max(1, min(numShards, numSegments)) : 1;
 
-    for (int i = 0; i < numBuckets; i++) {
-        init(&sems[i], 1);
+    // Shared stripes hold segments from every shard, so only a lock per segment can be placed
+    if (this->numShards > 1 && locks->size() == numSegments) {
+        vector<numa_node_t> nodes = readNumaNodes();
+        for (int shard = 0; shard < this->numShards; shard++) {
+            locks->place((long)shard * numSegments / this->numShards,
+                         (long)(shard + 1) * numSegments / this->numShards,
+                         nodes[shard % nodes.size()].id);
+        }
+    }
+
+    for (int i = 0; i < numSegments; i++) {
+        // Each table starts as a single bucket and grows with its segment. Growing a chained table
+        // moves a few buckets per operation, so no operation waits on a whole rehash.
+        segments[i] = newMapBackend(backend, 1, numSegments, true, hashPolicy);
+        if (unlockedLookups) unlockedLookups = segments[i]->enableUnlockedLookups();
     }
 }
 
 ConcurrentMap::~ConcurrentMap() {
-    for (int i = 0; i < numBuckets; i++) {
-        sem_destroy(&sems[i]);
+    for (int i = 0; i < numSegments; i++) {
+        delete segments[i];
     }
 
-    delete sems;
+    delete[] segments;
+    delete locks;
+}
+
+// Negative keys wrap so they still land in a segment
+int ConcurrentMap::segmentOf(int key) {
+    // Shifted as 64 bits so a single segment can shift away all 32 bits
+    if (hashPolicy == MIX_HASH) return (uint64_t)mixHash(key) >> segmentShift;
+    return (unsigned int)key % numSegments;
 }
 
-void ConcurrentMap::lock(int bucket) { wait(&sems[bucket]); }
+int ConcurrentMap::stripeOf(int segment) { return segment % locks->size(); }
 
-void ConcurrentMap::unlock(int bucket) { post(&sems[bucket]); }
+int ConcurrentMap::shards() { return numShards; }
 
 // Spin to demonstrate scaling
 void spin(int numCycles) { for (int i = 0; i < numCycles; i++); }
 
-bool ConcurrentMap::insertAndPost(int key, string value, sem_t* semOppStarted) {
-    int bucket = hash(key);
+bool ConcurrentMap::insertAndPost(int key, const char* value, size_t length,
+                                  sem_t* semOppStarted) {
+    int segment = segmentOf(key);
+    int stripe = stripeOf(segment);
 
-    lock(bucket);
+    locks->lock(stripe);
     // Tell caller opp has started
-    post(semOppStarted);
+    if (semOppStarted != nullptr) post(semOppStarted);
     spin(this->numCyclesToSleepPerOpp);
-    bool result = insert(key, value);
-    unlock(bucket);
+    bool result = segments[segment]->insert(key, value, length);
+    locks->unlock(stripe);
     return result;
 }
 
-string ConcurrentMap::lookupAndPost(int key, sem_t* semOppStarted) {
-    int bucket = hash(key);
+void ConcurrentMap::executeBulk(bulk_op_t* opps, size_t count) {
+    // Counting sort by segment groups the operations while keeping their order, so operations on
+    // the same key still see each other. Only the segments the operations touch are counted and
+    // visited, and each thread keeps its scratch so runs stop allocating once it fits.
+    static thread_local vector<uint32_t> groupEnds;
+    static thread_local vector<int> touched;
+    static thread_local vector<int> oppSegments;
+    static thread_local vector<uint32_t> order;
+    // Entries are left at 0 between runs, whatever map ran last
+    if (groupEnds.size() < (size_t)numSegments) groupEnds.resize(numSegments, 0);
+    touched.clear();
+    oppSegments.resize(count);
+    order.resize(count);
+
+    for (size_t i = 0; i < count; i++) {
+        int segment = segmentOf(opps[i].key);
+        oppSegments[i] = segment;
+        if (groupEnds[segment]++ == 0) touched.push_back(segment);
+    }
+    uint32_t groupEnd = 0;
+    for (int segment : touched) {
+        groupEnd += groupEnds[segment];
+        groupEnds[segment] = groupEnd;
+    }
+    // Filling each group from its end leaves groupEnds at each group's start
+    for (size_t i = count; i-- > 0;) {
+        order[--groupEnds[oppSegments[i]]] = i;
+    }
+
+    for (size_t group = 0; group < touched.size(); group++) {
+        int segment = touched[group];
+        size_t start = groupEnds[segment];
+        size_t stop = group + 1 < touched.size() ? groupEnds[touched[group + 1]] : count;
+
+        long numInserts = 0;
+        bool onlyLookups = true;
+        for (size_t i = start; i < stop; i++) {
+            bulk_op_type_t type = opps[order[i]].type;
+            if (type == BULK_INSERT) numInserts++;
+            if (type != BULK_LOOKUP) onlyLookups = false;
+        }
+
+        int stripe = stripeOf(segment);
+        MapBackend* table = segments[segment];
+        if (onlyLookups) {
+            locks->lockShared(stripe);
+        } else {
+            locks->lock(stripe);
+        }
+        if (numInserts > 0) table->reserve(numInserts);
+        for (size_t i = start; i < stop; i++) {
+            bulk_op_t* opp = &opps[order[i]];
+            if (opp->type == BULK_INSERT) {
+                opp->succeeded = table->insert(opp->key, opp->value, opp->length);
+            } else if (opp->type == BULK_REMOVE) {
+                opp->succeeded = table->remove(opp->key);
+            } else {
+                opp->succeeded = lookupInto(segment, opp->key, &opp->found);
+            }
+        }
+        if (onlyLookups) {
+            locks->unlockShared(stripe);
+        } else {
+            locks->unlock(stripe);
+        }
+    }
+    for (int segment : touched) groupEnds[segment] = 0;
+}
+
+bool ConcurrentMap::lookupInto(int segment, int key, string* result) {
+    const char* value;
+    size_t length;
+    if (!segments[segment]->lookup(key, &value, &length)) {
+        result->clear();
+        return false;
+    }
+
+    result->assign(value, length);
+    return true;
+}
 
-    lock(bucket);
+bool ConcurrentMap::tryUnlockedLookup(int segment, int stripe, int key, string* result,
+                                      bool* found) {
+    if (!epochEnter()) return false;
+
+    bool valid = false;
+    for (int i = 0; i < MAX_UNLOCKED_LOOKUP_TRIES && !valid; i++) {
+        unsigned int version = locks->readBegin(stripe);
+        spin(numCyclesToSleepPerOpp);
+        // Removed values stay allocated until the epoch moves on, so racing a writer copies a
+        // stale value at worst, which the validation throws out
+        *found = lookupInto(segment, key, result);
+        valid = locks->readValidate(stripe, version);
+    }
+
+    epochExit();
+    return valid;
+}
+
+bool ConcurrentMap::lookupAndPost(int key, string* result, sem_t* semOppStarted) {
+    int segment = segmentOf(key);
+    int stripe = stripeOf(segment);
+
+    // A caller waiting for the lookup to start needs it ordered before later writes, which only
+    // the lock provides
+    bool found;
+    if (unlockedLookups && semOppStarted == nullptr &&
+        tryUnlockedLookup(segment, stripe, key, result, &found)) {
+        return found;
+    }
+
+    // Lookups only read the table, so they can share the stripe
+    locks->lockShared(stripe);
     // Tell caller opp has started
-    post(semOppStarted);
+    if (semOppStarted != nullptr) post(semOppStarted);
     spin(numCyclesToSleepPerOpp);
-    string result = lookup(key);
-    unlock(bucket);
-    return result;
+    found = lookupInto(segment, key, result);
+    locks->unlockShared(stripe);
+    return found;
 }
 
 bool ConcurrentMap::removeAndPost(int key, sem_t* semOppStarted) {
-    int bucket = hash(key);
+    int segment = segmentOf(key);
+    int stripe = stripeOf(segment);
 
-    lock(bucket);
+    locks->lock(stripe);
     // Tell caller opp has started
-    post(semOppStarted);
+    if (semOppStarted != nullptr) post(semOppStarted);
     spin(numCyclesToSleepPerOpp);
-    bool result = remove(key);
-    unlock(bucket);
+    bool result = segments[segment]->remove(key);
+    locks->unlock(stripe);
     return result;
 }
+
+map_stats_t ConcurrentMap::stats() {
+    map_stats_t stats = {};
+    for (int segment = 0; segment < numSegments; segment++) {
+        int stripe = stripeOf(segment);
+        long sizeBefore = stats.size;
+
+        locks->lockShared(stripe);
+        segments[segment]->addStats(&stats);
+        locks->unlockShared(stripe);
+
+        long segmentSize = stats.size - sizeBefore;
+        stats.numSegments++;
+        if (segmentSize == 0) stats.emptySegments++;
+        stats.largestSegment = max(stats.largestSegment, segmentSize);
+    }
+
+    stats.memoryBytes += sizeof(ConcurrentMap) + numSegments * sizeof(MapBackend*) +
+                         sizeof(StripedLock) + locks->size() * sizeof(stripe_lock_t);
+    return stats;
+}
+
+void ConcurrentMap::visit(entry_visitor_t visitor, void* context) {
+    for (int segment = 0; segment < numSegments; segment++) {
+        int stripe = stripeOf(segment);
+        locks->lockShared(stripe);
+        segments[segment]->visit(visitor, context);
+        locks->unlockShared(stripe);
+    }
+}
@@ -1,31 +1,117 @@
+#pragma once
+
 #include <string>
 
-#include "Map.h"
+#include "MapBackend.h"
 #include "Semaphore.h"
+#include "StripedLock.h"
 
 using namespace std;
 
-class ConcurrentMap : Map {
+enum bulk_op_type_t {
+    BULK_INSERT,
+    BULK_LOOKUP,
+    BULK_REMOVE,
+};
+
+// Operation given to ConcurrentMap::executeBulk, which fills in its result
+struct bulk_op_t {
+    bulk_op_type_t type;
+
+    int key;
+
+    // Value to insert
+    const char* value;
+
+    size_t length;
+
+    // Whether the insert or remove succeeded, or the lookup found key
+    bool succeeded;
+
+    // Value a lookup found
+    string found;
+};
+
+// Map split into segments that each have their own table. Segments share a fixed number of lock
+// stripes.
+class ConcurrentMap {
   private:
-    // Array of sems, one for each bucket
-    sem_t* sems;
+    int numSegments;
+
+    hash_policy_t hashPolicy;
+
+    // Shift that keeps the top bits of a mixed hash, which pick the segment
+    int segmentShift;
 
-    void lock(int bucket);
+    // Array of tables, one for each segment
+    MapBackend** segments;
 
-    void unlock(int bucket);
+    StripedLock* locks;
 
-    void signal(sem_t*);
+    // Contiguous blocks of segments, each kept on its own NUMA node
+    int numShards;
+
+    // Whether lookups read without the lock and validate against the stripe's version
+    bool unlockedLookups;
+
+    int segmentOf(int key);
+
+    int stripeOf(int segment);
+
+    // Copies the value of key into result, or clears it if key is missing. Returns whether key was
+    // found. The caller keeps the segment from changing.
+    bool lookupInto(int segment, int key, string* result);
+
+    // Looks up key without locking. Returns false if writers kept interrupting it.
+    bool tryUnlockedLookup(int segment, int stripe, int key, string* result, bool* found);
 
     int numCyclesToSleepPerOpp;
 
   public:
-    ConcurrentMap(int numBuckets = 1000, int oppPaddingCycles = 0);
+    // Each of the numBuckets buckets holds its own table that grows as keys are added.
+    // Buckets are locked by numStripes locks, or one lock each if numStripes is 0. A mixing hash
+    // rounds numBuckets up to a power of two.
+    // The buckets are split into numShards shards by the top bits of their hash, and shard i's
+    // locks are kept on NUMA node i modulo the number of nodes. Tables allocate as they grow, so
+    // they land on the node of whichever thread inserts into them. Only a mixing hash is sharded.
+    ConcurrentMap(int numBuckets = 1000, int oppPaddingCycles = 0,
+                  map_backend_t backend = CHAINED_BACKEND,
+                  lock_strategy_t lockStrategy = SEMAPHORE_LOCK, int numStripes = 0,
+                  hash_policy_t hashPolicy = MIX_HASH, int numShards = 1);
 
     ~ConcurrentMap();
 
-    bool insertAndPost(int, string, sem_t*);
+    int shards();
+
+    // Copies length bytes of value into the map
+    bool insertAndPost(int key, const char* value, size_t length, sem_t* semOppStarted);
+
+    bool insertAndPost(int key, const string& value, sem_t* semOppStarted) {
+        return insertAndPost(key, value.data(), value.length(), semOppStarted);
+    }
 
     bool removeAndPost(int, sem_t*);
 
-    string lookupAndPost(int, sem_t*);
+    // Copies the value of key into result, which keeps its capacity between calls so lookups stop
+    // allocating once values fit. Returns false and clears result if key is missing.
+    bool lookupAndPost(int key, string* result, sem_t* semOppStarted);
+
+    string lookupAndPost(int key, sem_t* semOppStarted) {
+        string result;
+        lookupAndPost(key, &result, semOppStarted);
+        return result;
+    }
+
+    // Runs count operations, fewer than 2^32, as if they ran one after another and fills in their
+    // results. Operations are grouped by segment, keeping their order within a segment, so each
+    // segment is locked once and grown once for its inserts. A group of only lookups shares its
+    // lock.
+    void executeBulk(bulk_op_t* opps, size_t count);
+
+    // Adds up the stats of every segment. Each segment is read under its stripe's lock, so
+    // operations on other stripes keep running while the map is sampled.
+    map_stats_t stats();
+
+    // Calls visitor with every entry, one segment at a time under its stripe's lock
+    void visit(entry_visitor_t visitor, void* context);
 };
@@ -0,0 +1,144 @@
+#include "Counters.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <iostream>
+#include <new>
+#include <vector>
+
+const char* COUNTER_NAMES[NUM_COUNTERS] = {
+    "lines_read",
+    "inserts",
+    "lookups",
+    "deletes",
+    "malformed_lines",
+    "read_ns",
+    "parse_ns",
+    "execute_ns",
+    "write_ns",
+    "read_lock_wait_ns",
+    "turn_wait_ns",
+    "schedule_lock_wait_ns",
+    "idle_ns",
+    "steals",
+    "bucket_locks",
+    "bucket_locks_contended",
+    "waits_slept",
+};
+
+atomic<bool> countersEnabled(false);
+
+// On its own cache lines so threads don't slow each other down counting
+struct alignas(64) thread_counters_t {
+    // Only the owning thread writes, so these are atomic only to be read while it runs
+    atomic<unsigned long> values[NUM_COUNTERS];
+
+    const char* role;
+};
+
+// Counters of every thread that has counted, kept after the thread exits so they are summarized
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<thread_counters_t*>* threads = new vector<thread_counters_t*>();
+
+static thread_local thread_counters_t* ownCounters = nullptr;
+
+static thread_counters_t* getOwnCounters() {
+    if (ownCounters == nullptr) {
+        // new doesn't align past 16 bytes before C++17
+        void* memory;
+        size_t alignment = alignof(thread_counters_t);
+        while (posix_memalign(&memory, alignment, sizeof(thread_counters_t)) != 0) {
+            cout << "Error allocating counters\n";
+        }
+        ownCounters = new (memory) thread_counters_t;
+        for (atomic<unsigned long>& value : ownCounters->values) {
+            value.store(0, memory_order_relaxed);
+        }
+        ownCounters->role = "thread";
+
+        pthread_mutex_lock(&threadsLock);
+        threads->push_back(ownCounters);
+        pthread_mutex_unlock(&threadsLock);
+    }
+    return ownCounters;
+}
+
+void addCounter(counter_t counter, unsigned long amount) {
+    atomic<unsigned long>* value = &getOwnCounters()->values[counter];
+    value->store(value->load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+unsigned long counterClockNanos() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void setCounterRole(const char* role) {
+    if (countersEnabled.load(memory_order_relaxed)) getOwnCounters()->role = role;
+}
+
+unsigned long counterTotal(counter_t counter) {
+    unsigned long total = 0;
+    pthread_mutex_lock(&threadsLock);
+    for (thread_counters_t* counters : *threads) {
+        total += counters->values[counter].load(memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&threadsLock);
+    return total;
+}
+
+// Writes counters that are not zero
+static void writeValues(ostream* output, unsigned long* values, bool json) {
+    bool first = true;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (values[i] == 0) continue;
+
+        if (json) {
+            *output << (first ? "" : ", ") << "\"" << COUNTER_NAMES[i] << "\": " << values[i];
+        } else {
+            *output << " " << COUNTER_NAMES[i] << "=" << values[i];
+        }
+        first = false;
+    }
+}
+
+void writeCounters(ostream* output, bool json) {
+    unsigned long totals[NUM_COUNTERS] = {};
+
+    pthread_mutex_lock(&threadsLock);
+
+    *output << (json ? "{\"threads\": [" : "Counters:\n");
+    for (size_t i = 0; i < threads->size(); i++) {
+        unsigned long values[NUM_COUNTERS];
+        for (int j = 0; j < NUM_COUNTERS; j++) {
+            values[j] = (*threads)[i]->values[j].load(memory_order_relaxed);
+            totals[j] += values[j];
+        }
+
+        if (json) {
+            *output << (i == 0 ? "\n" : ",\n") << "  {\"thread\": " << i << ", \"role\": \""
+                    << (*threads)[i]->role << "\", \"counters\": {";
+            writeValues(output, values, true);
+            *output << "}}";
+        } else {
+            *output << "  thread " << i << " (" << (*threads)[i]->role << "):";
+            writeValues(output, values, false);
+            *output << "\n";
+        }
+    }
+
+    pthread_mutex_unlock(&threadsLock);
+
+    if (json) {
+        *output << "\n], \"total\": {";
+        writeValues(output, totals, true);
+        *output << "}}\n";
+    } else {
+        *output << "  total:";
+        writeValues(output, totals, false);
+        *output << "\n";
+    }
+}
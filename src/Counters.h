@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+
+using namespace std;
+
+// Per-thread counters for finding where time goes without a profiler.
+// Each thread only writes its own counters, so counting is a plain add, and nothing is counted
+// until counters are enabled.
+
+enum counter_t {
+    LINES_READ,
+    INSERTS,
+    LOOKUPS,
+    DELETES,
+    MALFORMED_LINES,
+    // Time in each stage of running a line, in nanoseconds
+    READ_NS,
+    PARSE_NS,
+    EXECUTE_NS,
+    WRITE_NS,
+    // Time sequenced consumers spend waiting, in nanoseconds
+    READ_LOCK_WAIT_NS,
+    TURN_WAIT_NS,
+    SCHEDULE_LOCK_WAIT_NS,
+    // Time partitioned workers spend with nothing to run, in nanoseconds
+    IDLE_NS,
+    // Partitions a worker took from another worker's deque
+    STEALS,
+    BUCKET_LOCKS,
+    // Bucket locks that were already held when taken
+    BUCKET_LOCKS_CONTENDED,
+    // Ordering waits that ran out of spins and yields and slept
+    WAITS_SLEPT,
+    NUM_COUNTERS,
+};
+
+extern const char* COUNTER_NAMES[NUM_COUNTERS];
+
+extern atomic<bool> countersEnabled;
+
+void addCounter(counter_t counter, unsigned long amount);
+
+inline void count(counter_t counter, unsigned long amount = 1) {
+    if (countersEnabled.load(memory_order_relaxed)) addCounter(counter, amount);
+}
+
+unsigned long counterClockNanos();
+
+// Returns the start time of a stage, or 0 if counters are off
+inline unsigned long startTimer() {
+    return countersEnabled.load(memory_order_relaxed) ? counterClockNanos() : 0;
+}
+
+// Adds the time since start to counter
+inline void stopTimer(counter_t counter, unsigned long start) {
+    if (start != 0) addCounter(counter, counterClockNanos() - start);
+}
+
+// Names what the calling thread does in the summary
+void setCounterRole(const char* role);
+
+// Sums counter over every thread that has counted
+unsigned long counterTotal(counter_t counter);
+
+// Writes each thread's counters and their totals, as text or as JSON
+void writeCounters(ostream* output, bool json);
@@ -0,0 +1,134 @@
+#include "Epoch.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+// Retired pointers a thread collects before it tries to free them
+const int RECLAIM_BATCH = 64;
+
+// Epoch of a slot whose thread is not reading
+const unsigned long IDLE_EPOCH = ~0UL;
+
+// Each reader announces its epoch on its own cache line
+struct alignas(64) epoch_slot_t {
+    atomic<unsigned long> epoch;
+
+    atomic<bool> claimed;
+};
+
+struct retired_t {
+    void* ptr;
+
+    void (*freeFn)(void*);
+
+    // Global epoch when ptr was unlinked
+    unsigned long epoch;
+};
+
+static atomic<unsigned long> globalEpoch(0);
+
+static epoch_slot_t slots[MAX_EPOCH_THREADS];
+
+// Retired pointers left behind by threads that exited
+static pthread_mutex_t orphanLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<retired_t>* orphans = new vector<retired_t>();
+
+// Advances the global epoch if every reader has seen the current one
+static void tryAdvance() {
+    unsigned long epoch = globalEpoch.load();
+    for (epoch_slot_t& slot : slots) {
+        if (!slot.claimed.load()) continue;
+
+        unsigned long slotEpoch = slot.epoch.load();
+        if (slotEpoch != IDLE_EPOCH && slotEpoch != epoch) return;
+    }
+    globalEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+// Frees the pointers that no reader can hold and keeps the rest
+static void reclaim(vector<retired_t>* retired) {
+    tryAdvance();
+    unsigned long epoch = globalEpoch.load();
+
+    // Readers inside the epoch a pointer was retired in may still hold it, and so may readers
+    // in the epoch before that haven't exited yet
+    size_t kept = 0;
+    for (retired_t& item : *retired) {
+        if (item.epoch + 2 <= epoch) {
+            item.freeFn(item.ptr);
+        } else {
+            (*retired)[kept++] = item;
+        }
+    }
+    retired->resize(kept);
+}
+
+struct epoch_thread_t {
+    // Index into slots, or -1 if none were free
+    int slot;
+
+    vector<retired_t> retired;
+
+    epoch_thread_t() {
+        slot = -1;
+        for (int i = 0; i < MAX_EPOCH_THREADS; i++) {
+            bool expected = false;
+            if (!slots[i].claimed.load() &&
+                slots[i].claimed.compare_exchange_strong(expected, true)) {
+                slots[i].epoch.store(IDLE_EPOCH);
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    ~epoch_thread_t() {
+        if (slot != -1) slots[slot].claimed.store(false);
+
+        // Readers may still hold what this thread retired, so another thread frees it later
+        pthread_mutex_lock(&orphanLock);
+        orphans->insert(orphans->end(), retired.begin(), retired.end());
+        pthread_mutex_unlock(&orphanLock);
+    }
+};
+
+static thread_local epoch_thread_t thisThread;
+
+bool epochEnter() {
+    if (thisThread.slot == -1) return false;
+
+    // Sequentially consistent so writers that look at the slot after this see the reader before
+    // it reads anything they might retire
+    slots[thisThread.slot].epoch.store(globalEpoch.load());
+    return true;
+}
+
+void epochExit() { slots[thisThread.slot].epoch.store(IDLE_EPOCH, memory_order_release); }
+
+void epochRetire(void* ptr, void (*freeFn)(void*)) {
+    thisThread.retired.push_back({ptr, freeFn, globalEpoch.load()});
+    if (thisThread.retired.size() < RECLAIM_BATCH) return;
+
+    reclaim(&thisThread.retired);
+
+    // Free what exited threads left behind while the epoch is known to be moving
+    if (pthread_mutex_trylock(&orphanLock) == 0) {
+        if (!orphans->empty()) {
+            reclaim(orphans);
+        }
+        pthread_mutex_unlock(&orphanLock);
+    }
+}
+
+unsigned long epochCurrent() { return globalEpoch.load(); }
+
+bool epochPassed(unsigned long epoch) {
+    if (epoch + 2 <= globalEpoch.load()) return true;
+
+    tryAdvance();
+    return epoch + 2 <= globalEpoch.load();
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Epoch-based reclamation for structures that are read without locks.
+// Readers wrap each traversal in epochEnter and epochExit, and writers retire memory they unlink
+// instead of freeing it. Retired memory is freed once every reader that could still hold it has
+// exited.
+
+// Threads that can be inside an epoch at once
+const int MAX_EPOCH_THREADS = 256;
+
+// Returns false if every reader slot is taken, in which case the caller must lock instead
+bool epochEnter();
+
+void epochExit();
+
+// Calls freeFn on ptr once no reader can still hold it
+void epochRetire(void* ptr, void (*freeFn)(void*));
+
+// Returns the epoch to tag memory with when it is unlinked
+unsigned long epochCurrent();
+
+// Returns true once no reader can still hold memory unlinked during epoch.
+// For owners that recycle their own memory instead of retiring it.
+bool epochPassed(unsigned long epoch);
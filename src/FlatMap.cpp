@@ -0,0 +1,186 @@
+#include "FlatMap.h"
+
+#include <climits>
+#include <cstring>
+#include <string>
+
+// Smallest table that is allocated
+const int MIN_FLAT_SLOTS = 8;
+
+FlatMap::FlatMap(int numBuckets) {
+    numUsed = 0;
+    arenaGarbage = 0;
+
+    int initialSlots = MIN_FLAT_SLOTS;
+    while (initialSlots < numBuckets) initialSlots *= 2;
+    rebuild(initialSlots);
+}
+
+int FlatMap::homeSlot(int key) {
+    // Multiplicative hashing keeps the top bits, so keys that share their low bits still spread
+    return ((uint32_t)key * 2654435769u) >> slotShift;
+}
+
+int FlatMap::findSlot(int key) {
+    int mask = numSlots - 1;
+    for (int slot = homeSlot(key); used[slot]; slot = (slot + 1) & mask) {
+        if (keys[slot] == key) return slot;
+    }
+    return -1;
+}
+
+int FlatMap::findEmptySlot(int key) {
+    int mask = numSlots - 1;
+    int slot = homeSlot(key);
+    while (used[slot]) slot = (slot + 1) & mask;
+    return slot;
+}
+
+void FlatMap::storeValue(const char* value, size_t length, flat_value_t* slotValue) {
+    slotValue->length = length;
+    if (length <= INLINE_VALUE_BYTES) {
+        memcpy(slotValue->bytes, value, length);
+        return;
+    }
+
+    uint64_t offset = arena.size();
+    arena.insert(arena.end(), value, value + length);
+    memcpy(slotValue->bytes, &offset, sizeof(offset));
+}
+
+const char* FlatMap::valueData(flat_value_t* slotValue) {
+    if (slotValue->length <= INLINE_VALUE_BYTES) return slotValue->bytes;
+
+    uint64_t offset;
+    memcpy(&offset, slotValue->bytes, sizeof(offset));
+    return arena.data() + offset;
+}
+
+void FlatMap::releaseValue(flat_value_t* slotValue) {
+    if (slotValue->length <= INLINE_VALUE_BYTES) return;
+    arenaGarbage += slotValue->length;
+
+    // Compact once garbage is most of the arena and outweighs the cost of visiting every slot
+    if (arenaGarbage > arena.size() / 2 && arenaGarbage >= numSlots * sizeof(flat_value_t)) {
+        rebuild(numSlots);
+    }
+}
+
+void FlatMap::rebuild(int newNumSlots) {
+    vector<uint8_t> oldUsed(newNumSlots, 0);
+    vector<int> oldKeys(newNumSlots);
+    vector<flat_value_t> oldValues(newNumSlots);
+    vector<char> oldArena;
+    used.swap(oldUsed);
+    keys.swap(oldKeys);
+    values.swap(oldValues);
+    arena.swap(oldArena);
+    arenaGarbage = 0;
+
+    numSlots = newNumSlots;
+    slotShift = 32;
+    for (int slots = numSlots; slots > 1; slots /= 2) slotShift--;
+
+    for (size_t i = 0; i < oldUsed.size(); i++) {
+        if (!oldUsed[i]) continue;
+
+        int slot = findEmptySlot(oldKeys[i]);
+        used[slot] = 1;
+        keys[slot] = oldKeys[i];
+        values[slot] = oldValues[i];
+
+        if (oldValues[i].length > INLINE_VALUE_BYTES) {
+            uint64_t oldOffset;
+            memcpy(&oldOffset, oldValues[i].bytes, sizeof(oldOffset));
+            uint64_t offset = arena.size();
+            arena.insert(arena.end(), oldArena.begin() + oldOffset,
+                         oldArena.begin() + oldOffset + oldValues[i].length);
+            memcpy(values[slot].bytes, &offset, sizeof(offset));
+        }
+    }
+}
+
+bool FlatMap::insert(int key, const char* value, size_t length) {
+    // If key already exists, fail to insert
+    if (findSlot(key) != -1) return false;
+
+    if ((numUsed + 1) * 4 > (long)numSlots * 3) rebuild(numSlots * 2);
+
+    int slot = findEmptySlot(key);
+    used[slot] = 1;
+    keys[slot] = key;
+    storeValue(value, length, &values[slot]);
+    numUsed++;
+
+    return true;
+}
+
+void FlatMap::reserve(long extraEntries) {
+    long newNumSlots = numSlots;
+    while ((numUsed + extraEntries) * 4 > newNumSlots * 3 && newNumSlots <= INT_MAX / 2) {
+        newNumSlots *= 2;
+    }
+    if (newNumSlots != numSlots) rebuild(newNumSlots);
+}
+
+bool FlatMap::lookup(int key, const char** value, size_t* length) {
+    int slot = findSlot(key);
+    if (slot == -1) return false;
+
+    *value = valueData(&values[slot]);
+    *length = values[slot].length;
+    return true;
+}
+
+bool FlatMap::remove(int key) {
+    int slot = findSlot(key);
+    if (slot == -1) return false;
+
+    // Pull later entries of the run back into the hole if their probe sequence passes through it,
+    // otherwise they would become unreachable
+    int mask = numSlots - 1;
+    int hole = slot;
+    flat_value_t removedValue = values[slot];
+    for (int next = (hole + 1) & mask; used[next]; next = (next + 1) & mask) {
+        int home = homeSlot(keys[next]);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            keys[hole] = keys[next];
+            values[hole] = values[next];
+            hole = next;
+        }
+    }
+    used[hole] = 0;
+    numUsed--;
+
+    // Released last since it may rebuild the table
+    releaseValue(&removedValue);
+    return true;
+}
+
+long FlatMap::size() { return numUsed; }
+
+void FlatMap::addStats(map_stats_t* stats) {
+    stats->size += numUsed;
+    stats->memoryBytes += sizeof(FlatMap) + used.capacity() * sizeof(uint8_t) +
+                          keys.capacity() * sizeof(int) +
+                          values.capacity() * sizeof(flat_value_t) + arena.capacity();
+
+    // The table is never full, so starting just after an empty slot every run is seen whole.
+    // Walking backwards, each slot's chain is one more than the next slot's.
+    int mask = numSlots - 1;
+    int start = 0;
+    while (used[start]) start++;
+
+    long runAfter = 0;
+    for (int i = 0; i < numSlots; i++) {
+        int slot = (start - i) & mask;
+        runAfter = used[slot] ? runAfter + 1 : 0;
+        addChain(stats, runAfter);
+    }
+}
+
+void FlatMap::visit(entry_visitor_t visitor, void* context) {
+    for (int slot = 0; slot < numSlots; slot++) {
+        if (used[slot]) visitor(keys[slot], valueData(&values[slot]), values[slot].length, context);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "MapBackend.h"
+
+using namespace std;
+
+// Values up to this many bytes are stored in their slot instead of the arena
+const int INLINE_VALUE_BYTES = 12;
+
+// Value of an occupied slot
+struct flat_value_t {
+    uint32_t length;
+
+    // The value itself if it fits, otherwise its offset into the arena
+    char bytes[INLINE_VALUE_BYTES];
+};
+
+// Open addressing hash table with linear probing. Keys are kept in a contiguous array so a probe
+// reads neighboring slots instead of chasing nodes, and removing a key shifts the rest of its run
+// back instead of leaving a tombstone. The table doubles before it is three quarters full.
+class FlatMap : public MapBackend {
+  private:
+    // Always a power of two
+    int numSlots;
+
+    // Shift that maps a mixed 32 bit hash to a slot
+    int slotShift;
+
+    long numUsed;
+
+    // Whether each slot holds an entry
+    vector<uint8_t> used;
+
+    vector<int> keys;
+
+    vector<flat_value_t> values;
+
+    // Values too long to store in their slot, back to back
+    vector<char> arena;
+
+    // Bytes in the arena left behind by removed values
+    size_t arenaGarbage;
+
+    int homeSlot(int key);
+
+    // Returns the slot holding key, or -1
+    int findSlot(int key);
+
+    // Returns the first empty slot in key's probe sequence
+    int findEmptySlot(int key);
+
+    void storeValue(const char* value, size_t length, flat_value_t* slotValue);
+
+    const char* valueData(flat_value_t* slotValue);
+
+    void releaseValue(flat_value_t* slotValue);
+
+    // Moves every entry into a table of newNumSlots slots and a compacted arena
+    void rebuild(int newNumSlots);
+
+  public:
+    FlatMap(int numBuckets = 1000);
+
+    using MapBackend::insert;
+
+    using MapBackend::lookup;
+
+    bool insert(int key, const char* value, size_t length) override;
+
+    bool remove(int) override;
+
+    bool lookup(int key, const char** value, size_t* length) override;
+
+    long size();
+
+    void reserve(long extraEntries) override;
+
+    void addStats(map_stats_t* stats) override;
+
+    void visit(entry_visitor_t visitor, void* context) override;
+};
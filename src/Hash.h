@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+using namespace std;
+
+enum hash_policy_t {
+    // Mixes every bit of the key into every bit of the hash, and uses power of two bucket counts
+    // so a bucket is picked with a mask or shift instead of a division (default)
+    MIX_HASH,
+    // The key modulo the bucket count, the original hash. Fast for keys that are already spread
+    // out, but keys that share a factor with the bucket count land in few buckets.
+    MODULO_HASH,
+};
+
+// Finalizer from MurmurHash3. Keys that differ in any bit, such as multiples of a large power of
+// two, differ in about half the bits of their hashes.
+inline uint32_t mixHash(int key) {
+    uint32_t hash = key;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Inverse of mixHash, which finds a key with a given hash
+inline int unmixHash(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x7ed1b41du;
+    hash ^= (hash >> 13) ^ (hash >> 26);
+    hash *= 0xa5cb9243u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Returns the smallest power of two that is at least count
+inline int roundUpToPowerOfTwo(int count) {
+    int powerOfTwo = 1;
+    while (powerOfTwo < count) powerOfTwo *= 2;
+    return powerOfTwo;
+}
@@ -0,0 +1,166 @@
+#include "KeyChains.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+
+#include "Counters.h"
+#include "Hash.h"
+#include "Semaphore.h"
+
+void writeParallelism(ostream* output, parallelism_t* parallelism) {
+    double average = 0;
+    if (parallelism->longestChain > 0) {
+        average = (double)parallelism->numOpps / parallelism->longestChain;
+    }
+    *output << "operations=" << parallelism->numOpps << " keys=" << parallelism->numKeys
+            << " longest_chain=" << parallelism->longestChain << " parallelism=" << average
+            << "\n";
+}
+
+// Slots in a new table. Each consumer holds one chain at a time, so few chains are ever needed.
+const size_t INITIAL_KEY_CHAIN_SLOTS = 64;
+
+// Slots in a new table of operation counts, which grows with the keys in the input
+const size_t INITIAL_KEY_COUNT_SLOTS = 1024;
+
+KeyChains::KeyChains()
+    : table(INITIAL_KEY_CHAIN_SLOTS, nullptr),
+      counts(INITIAL_KEY_COUNT_SLOTS, key_count_t{0, 0}) {
+    numInTable = 0;
+    parallelism = {0, 0, 0};
+}
+
+key_chain_t* KeyChains::findChain(int key) {
+    size_t mask = table.size() - 1;
+    size_t slot = mixHash(key) & mask;
+    while (table[slot] != nullptr) {
+        if (table[slot]->key == key) return table[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    key_chain_t* chain;
+    if (freeChains.empty()) {
+        // Value initialized, so the chain starts empty
+        chains.emplace_back();
+        chain = &chains.back();
+    } else {
+        // Nothing touches a chain without holders, so it can be reset in place
+        chain = freeChains.back();
+        freeChains.pop_back();
+        chain->numAdded = 0;
+        chain->numFinished = 0;
+        chain->numSleepers = 0;
+    }
+    chain->key = key;
+    table[slot] = chain;
+    numInTable++;
+    return chain;
+}
+
+void KeyChains::sweep() {
+    size_t numHeld = 0;
+    for (key_chain_t* chain : table) {
+        if (chain != nullptr && chain->numHolders.load() > 0) numHeld++;
+    }
+
+    size_t numSlots = table.size();
+    if (numHeld * 4 > numSlots) numSlots *= 2;
+    vector<key_chain_t*> swept(numSlots, nullptr);
+    size_t mask = numSlots - 1;
+    for (key_chain_t* chain : table) {
+        if (chain == nullptr) continue;
+        if (chain->numHolders.load() == 0) {
+            freeChains.push_back(chain);
+            continue;
+        }
+        size_t slot = mixHash(chain->key) & mask;
+        while (swept[slot] != nullptr) slot = (slot + 1) & mask;
+        swept[slot] = chain;
+    }
+    table.swap(swept);
+    numInTable = numHeld;
+}
+
+uint32_t KeyChains::countOperation(int key) {
+    size_t mask = counts.size() - 1;
+    size_t slot = mixHash(key) & mask;
+    while (counts[slot].count != 0 && counts[slot].key != key) slot = (slot + 1) & mask;
+
+    if (counts[slot].count == 0) {
+        if ((parallelism.numKeys + 1) * 2 > counts.size()) {
+            growCounts();
+            return countOperation(key);
+        }
+        counts[slot].key = key;
+        parallelism.numKeys++;
+    }
+    return ++counts[slot].count;
+}
+
+void KeyChains::growCounts() {
+    vector<key_count_t> grown(counts.size() * 2, key_count_t{0, 0});
+    size_t mask = grown.size() - 1;
+    for (key_count_t& keyCount : counts) {
+        if (keyCount.count == 0) continue;
+        size_t slot = mixHash(keyCount.key) & mask;
+        while (grown[slot].count != 0) slot = (slot + 1) & mask;
+        grown[slot] = keyCount;
+    }
+    counts.swap(grown);
+}
+
+key_turn_t KeyChains::add(int key) {
+    // Leaves room for the chain findChain may add
+    if ((numInTable + 1) * 2 > table.size()) sweep();
+    key_chain_t* chain = findChain(key);
+    uint32_t index = chain->numAdded++;
+    chain->numHolders++;
+
+    parallelism.numOpps++;
+    parallelism.longestChain =
+        max(parallelism.longestChain, (unsigned long)countOperation(key));
+    return {chain, index};
+}
+
+void KeyChains::waitForTurn(key_turn_t turn) {
+    key_chain_t* chain = turn.chain;
+    if (chain == nullptr) return;
+    if (spinThenYield([chain, turn] { return chain->numFinished.load() == turn.index; })) return;
+
+    count(WAITS_SLEPT);
+    while (true) {
+        uint32_t numFinished = chain->numFinished.load();
+        if (numFinished == turn.index) return;
+
+        // Registering before checking again pairs with finish counting before checking for
+        // sleepers, so one of them always sees the other
+        chain->numSleepers++;
+        if (chain->numFinished.load() == numFinished) {
+            // Returns right away if numFinished changed after it was read
+            syscall(SYS_futex, &chain->numFinished, FUTEX_WAIT_PRIVATE, numFinished, nullptr,
+                    nullptr, 0);
+        }
+        chain->numSleepers--;
+    }
+}
+
+void KeyChains::finish(key_turn_t turn) {
+    key_chain_t* chain = turn.chain;
+    if (chain == nullptr) return;
+
+    chain->numFinished++;
+    // Every operation left on the key may be sleeping, so all of them check whose turn it is
+    if (chain->numSleepers.load() > 0) {
+        syscall(SYS_futex, &chain->numFinished, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+    // Last, since the chain may be dropped and reused as soon as it has no holders
+    chain->numHolders--;
+}
+
+parallelism_t KeyChains::getParallelism() { return parallelism; }
+
+size_t KeyChains::getNumChains() { return chains.size(); }
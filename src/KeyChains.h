@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+
+// How much of an input can run at once when only operations on the same key are ordered
+struct parallelism_t {
+    // Operations on the map, not counting malformed lines
+    unsigned long numOpps;
+
+    unsigned long numKeys;
+
+    // Most operations on one key, which have to run one after another however many threads there
+    // are
+    unsigned long longestChain;
+};
+
+// Prints parallelism, along with the average number of operations that could run at once
+void writeParallelism(ostream* output, parallelism_t* parallelism);
+
+struct key_chain_t {
+    int key;
+
+    // Operations added on the key. Only touched by add.
+    uint32_t numAdded;
+
+    // Operations on the key that have finished. Waiters sleep on it.
+    atomic<uint32_t> numFinished;
+
+    atomic<int> numSleepers;
+
+    // Operations added on the key that haven't finished with the chain yet. Once it is 0 nothing
+    // else touches the chain, and add may drop it.
+    atomic<uint32_t> numHolders;
+};
+
+// Operations added on a key, for parallelism
+struct key_count_t {
+    int key;
+
+    // 0 for an empty slot
+    uint32_t count;
+};
+
+// Place of an operation in its key's chain
+struct key_turn_t {
+    // nullptr for an operation that doesn't touch the map, which doesn't wait
+    key_chain_t* chain;
+
+    uint32_t index;
+};
+
+// Chains the operations on each key in the order they are added, so an operation only waits for
+// the operation before it on the same key instead of for every operation before it
+class KeyChains {
+  private:
+    // Chains don't move when more are added, so they are used without holding the table
+    deque<key_chain_t> chains;
+
+    // Chains dropped from the table, reused before the deque grows
+    vector<key_chain_t*> freeChains;
+
+    // Open addressing table of chains by key with linear probing, kept at most half full. Only
+    // keys with operations that haven't finished need a chain, so the table only holds chains
+    // until the next sweep after their last operation finishes. Only add touches it.
+    vector<key_chain_t*> table;
+
+    size_t numInTable;
+
+    // Finds the chain for key, adding an empty one if there is none
+    key_chain_t* findChain(int key);
+
+    // Drops chains with no holders, and doubles the table if it is still over a quarter full
+    void sweep();
+
+    parallelism_t parallelism;
+
+    // Open addressing table of operation counts by key with linear probing, doubled before it is
+    // more than half full. Unlike chains, counts are kept for every key in the input.
+    vector<key_count_t> counts;
+
+    // Counts an operation on key and returns the operations counted on it so far
+    uint32_t countOperation(int key);
+
+    void growCounts();
+
+  public:
+    KeyChains();
+
+    // Adds an operation on key after the ones already added on it. Callers take turns adding, in
+    // input order.
+    key_turn_t add(int key);
+
+    // Returns once every operation added on the key before turn has finished. Waiters spin
+    // briefly, then yield, then sleep.
+    void waitForTurn(key_turn_t turn);
+
+    // Marks the operation at turn finished and wakes the operation after it
+    void finish(key_turn_t turn);
+
+    // Covers the operations added so far
+    parallelism_t getParallelism();
+
+    // Chains allocated so far, which stays near the most keys with operations held at once
+    size_t getNumChains();
+};
@@ -1,34 +1,164 @@
 #include "Map.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <string>
 
-Node::Node(int key, string value) {
+#include "Epoch.h"
+
+// Old buckets moved by each insert or remove while growing incrementally
+const int MIGRATE_BUCKETS_PER_OPP = 4;
+
+Node::Node(int key, const char* value, int valueLength, ValueArena* values) {
     this->key = key;
-    this->value = value;
+    this->valueLength = valueLength;
+    if (isInline()) {
+        memcpy(inlineValue, value, valueLength);
+    } else {
+        arenaValue.value = values->store(value, valueLength, &arenaValue.chunk);
+    }
     next = nullptr;
 }
 
-Map::Map(int numBuckets) {
-    this->numBuckets = numBuckets;
-    buckets = new Node*[numBuckets];
+bucket_table_t* newTable(int numBuckets) {
+    bucket_table_t* table = new bucket_table_t;
+    table->numBuckets = numBuckets;
+    table->buckets = new atomic<Node*>[numBuckets];
 
     for (int i = 0; i < numBuckets; i++) {
-        buckets[i] = nullptr;
+        table->buckets[i] = nullptr;
     }
+    return table;
+}
+
+void deleteTable(void* uncastTable) {
+    bucket_table_t* table = (bucket_table_t*)uncastTable;
+    delete[] table->buckets;
+    delete table;
+}
+
+Map::Map(int numBuckets, int keyStride, bool incrementalGrowth, hash_policy_t hashPolicy) {
+    this->hashPolicy = hashPolicy;
+    this->keyStride = keyStride;
+    this->incrementalGrowth = incrementalGrowth;
+    deferFrees = false;
+    numNodes = 0;
+    oldTable = nullptr;
+    nextBucketToMigrate = 0;
+    // Growing doubles the bucket count, so it stays a power of two
+    if (hashPolicy == MIX_HASH) numBuckets = roundUpToPowerOfTwo(numBuckets);
+    table = newTable(numBuckets);
 }
 
+// Nodes and values are freed in bulk by their allocators, so the chains aren't walked.
+// Nothing can read the map once it is being destroyed.
 Map::~Map() {
-    for (int i = 0; i < numBuckets; i++) {
-        while (buckets[i] != nullptr) {
-            remove(buckets[i]->key);
+    if (oldTable != nullptr) deleteTable(oldTable);
+    deleteTable(table);
+}
+
+// Negative keys wrap so they still land in a bucket
+int Map::hash(int value, int numBuckets) {
+    // A ConcurrentMap picks the segment from the top bits of the same hash, so the low bits are
+    // still spread within a segment
+    if (hashPolicy == MIX_HASH) return mixHash(value) & (numBuckets - 1);
+    return (unsigned int)value / keyStride % numBuckets;
+}
+
+atomic<Node*>* Map::bucketFor(int key) {
+    bucket_table_t* old = oldTable;
+    if (old != nullptr) {
+        int oldBucket = hash(key, old->numBuckets);
+        if (oldBucket >= nextBucketToMigrate) return &old->buckets[oldBucket];
+    }
+
+    bucket_table_t* current = table;
+    return &current->buckets[hash(key, current->numBuckets)];
+}
+
+long chainLength(Node* head) {
+    long length = 0;
+    for (Node* node = head; node != nullptr; node = node->next) length++;
+    return length;
+}
+
+void Map::freeNode(Node* node) {
+    if (!node->isInline()) values.release(node->arenaValue.chunk, node->valueLength);
+
+    // Unlocked lookups may still be reading the node, so it is only reused once they are done
+    if (deferFrees) {
+        nodes.retire(node);
+    } else {
+        nodes.release(node);
+    }
+}
+
+void Map::freeTable(bucket_table_t* table) {
+    if (deferFrees) {
+        epochRetire(table, deleteTable);
+    } else {
+        deleteTable(table);
+    }
+}
+
+void Map::grow() {
+    bucket_table_t* current = table;
+    // Doubling again would overflow the bucket count
+    if (current->numBuckets > INT_MAX / 2) return;
+
+    // A grow that is still moving buckets finishes first
+    bucket_table_t* old = oldTable;
+    if (old != nullptr) migrate(old->numBuckets);
+
+    // Lookups check the old table first, so it is published before the buckets it holds move
+    nextBucketToMigrate = 0;
+    oldTable = current;
+    table = newTable(current->numBuckets * 2);
+
+    if (!incrementalGrowth) migrate(current->numBuckets);
+}
+
+void Map::migrate(int count) {
+    bucket_table_t* old = oldTable;
+    if (old == nullptr) return;
+
+    bucket_table_t* current = table;
+    int bucket = nextBucketToMigrate;
+    int stop = min(old->numBuckets, bucket + count);
+    for (; bucket < stop; bucket++) {
+        // Nodes are moved one at a time from the front, so every node stays reachable from one
+        // of the two buckets
+        Node* node = old->buckets[bucket];
+        while (node != nullptr) {
+            Node* next = node->next;
+            atomic<Node*>* head = &current->buckets[hash(node->key, current->numBuckets)];
+            node->next = head->load();
+            *head = node;
+            old->buckets[bucket] = next;
+            node = next;
         }
+        nextBucketToMigrate = bucket + 1;
     }
 
-    delete buckets;
+    if (bucket == old->numBuckets) {
+        oldTable = nullptr;
+        freeTable(old);
+    }
 }
 
-int Map::hash(int value) { return value % numBuckets; }
+void Map::reserve(long extraEntries) {
+    while (numNodes + extraEntries > table.load()->numBuckets &&
+           table.load()->numBuckets <= INT_MAX / 2) {
+        grow();
+    }
+
+    // Every node moves now so the inserts that follow don't pay for it
+    bucket_table_t* old = oldTable;
+    if (old != nullptr) migrate(old->numBuckets);
+}
 
 bool Map::isKeyInBucket(int key, Node* head) {
     for (Node* node = head; node != nullptr; node = node->next) {
@@ -39,38 +169,43 @@ bool Map::isKeyInBucket(int key, Node* head) {
     return false;
 }
 
-bool Map::insert(int key, string value) {
-    int bucket = hash(key);
-    Node* bucketHead = buckets[bucket];
+bool Map::insert(int key, const char* value, size_t length) {
+    migrate(MIGRATE_BUCKETS_PER_OPP);
+    atomic<Node*>* bucketHead = bucketFor(key);
 
     // If key already exists, fail to insert
-    if (isKeyInBucket(key, bucketHead)) return false;
+    if (isKeyInBucket(key, *bucketHead)) return false;
 
-    Node* newNode = new Node(key, value);
-    newNode->next = bucketHead;
+    Node* newNode = new (nodes.allocate()) Node(key, value, length, &values);
+    newNode->next = bucketHead->load();
     // Make the new node the head of the bucket
-    buckets[bucket] = newNode;
+    *bucketHead = newNode;
+
+    numNodes++;
+    if (numNodes > table.load()->numBuckets) grow();
 
     return true;
 }
 
-string Map::lookup(int key) {
-    int bucket = hash(key);
-
-    for (Node* node = buckets[bucket]; node != nullptr; node = node->next) {
+// Lookups don't move buckets so they never write to the map
+bool Map::lookup(int key, const char** value, size_t* length) {
+    for (Node* node = *bucketFor(key); node != nullptr; node = node->next) {
         if (node->key == key) {
-            return node->value;
+            *value = node->value();
+            *length = node->valueLength;
+            return true;
         }
     }
 
-    return "";
+    return false;
 }
 
 bool Map::remove(int key) {
-    int bucket = hash(key);
+    migrate(MIGRATE_BUCKETS_PER_OPP);
+    atomic<Node*>* bucketHead = bucketFor(key);
 
     // Start search from the head of the bucket
-    Node* currNode = buckets[bucket];
+    Node* currNode = *bucketHead;
     // Stores the previously visited node so that when the current node is removed,
     // the previous node's next pointer can be updated
     Node* prevNode = nullptr;
@@ -79,12 +214,13 @@ bool Map::remove(int key) {
         if (currNode->key == key) {
             // If at head
             if (prevNode == nullptr) {
-                buckets[bucket] = currNode->next;
+                *bucketHead = currNode->next.load();
             } else {
-                prevNode->next = currNode->next;
+                prevNode->next = currNode->next.load();
             }
 
-            delete currNode;
+            freeNode(currNode);
+            numNodes--;
             return true;
         }
 
@@ -96,18 +232,66 @@ bool Map::remove(int key) {
     return false;
 }
 
+bool Map::enableUnlockedLookups() {
+    deferFrees = true;
+    values.setDeferFrees(true);
+    return true;
+}
+
+// Counts the current buckets and the old buckets that haven't been moved yet, since lookups read
+// both
+void Map::addStats(map_stats_t* stats) {
+    bucket_table_t* current = table;
+    bucket_table_t* old = oldTable;
+
+    stats->size += numNodes;
+    stats->memoryBytes += sizeof(Map) + nodes.memoryBytes() + values.memoryBytes() +
+                          sizeof(bucket_table_t) + current->numBuckets * sizeof(atomic<Node*>);
+
+    for (int i = 0; i < current->numBuckets; i++) {
+        addChain(stats, chainLength(current->buckets[i]));
+    }
+
+    if (old != nullptr) {
+        stats->memoryBytes += sizeof(bucket_table_t) + old->numBuckets * sizeof(atomic<Node*>);
+        for (int i = nextBucketToMigrate; i < old->numBuckets; i++) {
+            addChain(stats, chainLength(old->buckets[i]));
+        }
+    }
+}
+
+void visitChain(Node* head, entry_visitor_t visitor, void* context) {
+    for (Node* node = head; node != nullptr; node = node->next) {
+        visitor(node->key, node->value(), node->valueLength, context);
+    }
+}
+
+void Map::visit(entry_visitor_t visitor, void* context) {
+    bucket_table_t* current = table;
+    for (int i = 0; i < current->numBuckets; i++) {
+        visitChain(current->buckets[i], visitor, context);
+    }
+
+    bucket_table_t* old = oldTable;
+    if (old == nullptr) return;
+    for (int i = nextBucketToMigrate; i < old->numBuckets; i++) {
+        visitChain(old->buckets[i], visitor, context);
+    }
+}
+
 // For debugging
 void Map::printBuckets() {
-    for (int i = 0; i < numBuckets; i++) {
+    bucket_table_t* current = table;
+    for (int i = 0; i < current->numBuckets; i++) {
         cout << i << ": ";
-        printBucket(buckets[i]);
+        printBucket(current->buckets[i]);
     }
 }
 
 // For debugging
 void Map::printBucket(Node* head) {
     for (Node* node = head; node != nullptr; node = node->next) {
-        cout << "(" << node->key << ", " << node->value << ") -> ";
+        cout << "(" << node->key << ", " << string(node->value(), node->valueLength) << ") -> ";
     }
     cout << "\n";
 }
@@ -1,35 +1,121 @@
+#pragma once
+
+#include <atomic>
 #include <string>
 
+#include "Hash.h"
+#include "MapBackend.h"
+#include "Slab.h"
+#include "ValueArena.h"
+
 using namespace std;
 
+// Values up to this many bytes are stored in their node instead of the value arena. They take the
+// space the arena pointers would, so a node is the same size either way.
+const int MAX_INLINE_VALUE_LENGTH = 16;
+
+// Value stored in the map's value arena
+struct arena_value_t {
+    const char* value;
+
+    arena_chunk_t* chunk;
+};
+
 class Node {
   public:
-    Node(int, string);
+    // Copies value into the node if it fits, otherwise into values
+    Node(int key, const char* value, int valueLength, ValueArena* values);
     int key;
-    string value;
-    Node* next;
+    int valueLength;
+    union {
+        char inlineValue[MAX_INLINE_VALUE_LENGTH];
+        arena_value_t arenaValue;
+    };
+    // Atomic so unlocked lookups can follow the chain while a writer changes it
+    atomic<Node*> next;
+
+    bool isInline() { return valueLength <= MAX_INLINE_VALUE_LENGTH; }
+
+    const char* value() { return isInline() ? inlineValue : arenaValue.value; }
 };
 
-class Map {
-  protected:
+// Bucket heads together with their count, so unlocked lookups always see a matching pair
+struct bucket_table_t {
     int numBuckets;
 
-    Node** buckets;
+    atomic<Node*>* buckets;
+};
+
+// Chained hash map that doubles its buckets once it holds more nodes than buckets
+class Map : public MapBackend {
+  protected:
+    atomic<bucket_table_t*> table;
+
+    long numNodes;
+
+    hash_policy_t hashPolicy;
+
+    // Keys are divided by this before a modulo hash, so keys that are all congruent modulo the
+    // stride still spread across the buckets
+    int keyStride;
+
+    // Whether growing moves a few buckets on each insert or remove instead of all at once
+    bool incrementalGrowth;
 
-    int hash(int);
+    // Whether removed nodes and replaced tables are retired to the epoch reclaimer instead of
+    // being freed, because unlocked lookups may still be reading them
+    bool deferFrees;
+
+    Slab<Node> nodes;
+
+    ValueArena values;
+
+    // The previous table while growing incrementally, or nullptr
+    atomic<bucket_table_t*> oldTable;
+
+    // Old buckets before this have been moved
+    atomic<int> nextBucketToMigrate;
+
+    int hash(int, int numBuckets);
 
     bool isKeyInBucket(int, Node*);
 
+    // Returns the bucket that holds key, which is an old bucket if it has not been moved yet
+    atomic<Node*>* bucketFor(int key);
+
+    void grow();
+
+    // Moves up to count old buckets into the current buckets
+    void migrate(int count);
+
+    void freeNode(Node*);
+
+    void freeTable(bucket_table_t*);
+
   public:
-    Map(int numBuckets = 1000);
+    // A mixing hash rounds numBuckets up to a power of two and doesn't need keyStride
+    Map(int numBuckets = 1000, int keyStride = 1, bool incrementalGrowth = false,
+        hash_policy_t hashPolicy = MIX_HASH);
 
     ~Map();
 
-    bool insert(int, string);
+    using MapBackend::insert;
+
+    using MapBackend::lookup;
+
+    bool insert(int key, const char* value, size_t length) override;
+
+    bool remove(int) override;
+
+    bool lookup(int key, const char** value, size_t* length) override;
+
+    bool enableUnlockedLookups() override;
+
+    void reserve(long extraEntries) override;
 
-    bool remove(int);
+    void addStats(map_stats_t* stats) override;
 
-    string lookup(int);
+    void visit(entry_visitor_t visitor, void* context) override;
 
     void printBucket(Node*);
 
@@ -0,0 +1,40 @@
+#include "MapBackend.h"
+
+#include <algorithm>
+
+#include "FlatMap.h"
+#include "Map.h"
+
+MapBackend* newMapBackend(map_backend_t backend, int numBuckets, int keyStride,
+                          bool incrementalGrowth, hash_policy_t hashPolicy) {
+    // Flat tables mix the whole key, so they don't need the stride
+    if (backend == FLAT_BACKEND) return new FlatMap(numBuckets);
+    return new Map(numBuckets, keyStride, incrementalGrowth, hashPolicy);
+}
+
+void addChain(map_stats_t* stats, long length) {
+    stats->numBuckets++;
+    if (length == 0) stats->emptyBuckets++;
+    stats->longestChain = max(stats->longestChain, length);
+    stats->chainLengths[min(length, (long)MAX_CHAIN_LENGTH_COUNTED)]++;
+}
+
+void writeMapStats(ostream* output, map_stats_t* stats) {
+    double loadFactor = stats->numBuckets == 0 ? 0 : (double)stats->size / stats->numBuckets;
+    *output << "size=" << stats->size << " buckets=" << stats->numBuckets
+            << " load_factor=" << loadFactor << " empty_buckets=" << stats->emptyBuckets
+            << " longest_chain=" << stats->longestChain << " memory_bytes=" << stats->memoryBytes
+            << "\n";
+    if (stats->numSegments > 0) {
+        *output << "segments=" << stats->numSegments << " empty_segments=" << stats->emptySegments
+                << " largest_segment=" << stats->largestSegment << "\n";
+    }
+
+    *output << "chain lengths:";
+    for (int length = 0; length <= MAX_CHAIN_LENGTH_COUNTED; length++) {
+        if (stats->chainLengths[length] == 0) continue;
+        *output << " " << length << (length == MAX_CHAIN_LENGTH_COUNTED ? "+" : "") << "="
+                << stats->chainLengths[length];
+    }
+    *output << "\n";
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "Hash.h"
+
+using namespace std;
+
+enum map_backend_t {
+    // Buckets of linked nodes
+    CHAINED_BACKEND,
+    // Open addressing with keys in a contiguous array
+    FLAT_BACKEND,
+};
+
+// Chains at least this long share the last entry of the chain length histogram
+const int MAX_CHAIN_LENGTH_COUNTED = 16;
+
+// Shape of a map's tables, added up over every table in the map
+struct map_stats_t {
+    long size;
+
+    long numBuckets;
+
+    long emptyBuckets;
+
+    // A chain is the keys a lookup of a missing key compares, so in a flat table it is the run of
+    // slots from a bucket to the next empty slot
+    long longestChain;
+
+    // Number of buckets with each chain length
+    long chainLengths[MAX_CHAIN_LENGTH_COUNTED + 1];
+
+    // Bytes allocated by the tables, their entries, and their values
+    size_t memoryBytes;
+
+    // Tables in a ConcurrentMap, which are picked by key before their own buckets
+    long numSegments;
+
+    long emptySegments;
+
+    long largestSegment;
+};
+
+// Counts a bucket with a chain of length keys
+void addChain(map_stats_t* stats, long length);
+
+// Writes the stats as a short summary followed by the nonzero histogram entries
+void writeMapStats(ostream* output, map_stats_t* stats);
+
+// Called with each entry of a table
+typedef void (*entry_visitor_t)(int key, const char* value, size_t length, void* context);
+
+// Single-threaded table behind a map. Inserting an existing key fails and looking up a missing
+// key returns ""
+class MapBackend {
+  public:
+    virtual ~MapBackend() {}
+
+    // Copies length bytes of value into the table
+    virtual bool insert(int key, const char* value, size_t length) = 0;
+
+    bool insert(int key, const string& value) { return insert(key, value.data(), value.length()); }
+
+    virtual bool remove(int key) = 0;
+
+    // Points value at the stored bytes of key without copying them. The view is only valid until
+    // the table is next changed. Returns false if key is missing.
+    virtual bool lookup(int key, const char** value, size_t* length) = 0;
+
+    string lookup(int key) {
+        const char* value;
+        size_t length;
+        if (!lookup(key, &value, &length)) return "";
+        return string(value, length);
+    }
+
+    // Makes lookups safe to run alongside one writer by deferring frees to the epoch reclaimer.
+    // Such lookups may return a wrong result while a write is in progress, so callers validate
+    // them. Returns false if the table doesn't support it.
+    virtual bool enableUnlockedLookups() { return false; }
+
+    // Grows the table once so it can take extraEntries more entries without growing again
+    virtual void reserve(long extraEntries) = 0;
+
+    // Adds the table's size, buckets, and memory to stats. Takes time linear in the buckets and
+    // keys, so callers must keep writers out while it runs.
+    virtual void addStats(map_stats_t* stats) = 0;
+
+    // Calls visitor with every entry, in no particular order. The value is only valid during the
+    // call.
+    virtual void visit(entry_visitor_t visitor, void* context) = 0;
+};
+
+// Returns a table of the given type that starts with numBuckets buckets and grows as needed.
+// Every key in the table must be congruent modulo keyStride. A chained table moves its nodes a
+// few buckets at a time when it grows if incrementalGrowth is set, and picks buckets with
+// hashPolicy. Flat tables always mix their keys.
+MapBackend* newMapBackend(map_backend_t backend, int numBuckets, int keyStride = 1,
+                          bool incrementalGrowth = false, hash_policy_t hashPolicy = MIX_HASH);
@@ -1,14 +1,35 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <chrono>
+#include <climits>
+#include <fstream>
 #include <random>
 #include <string>
 
+#include "Counters.h"
+#include "FlatMap.h"
+#include "KeyChains.h"
+#include "Map.h"
 #include "Mapper.h"
+#include "MapperEngine.h"
+#include "Operation.h"
+#include "OutputBuffer.h"
+#include "Slab.h"
+#include "Snapshot.h"
+#include "Topology.h"
+#include "ReorderBuffer.h"
+#include "Sequence.h"
+#include "Workload.h"
 #include "gtest/gtest.h"
 
 class ThreadlessTest : public ::testing ::Test {
   protected:
     Map* map;
-    void SetUp() override { map = new Map(10); };
+    // Modulo hashing so the keys below share a bucket
+    void SetUp() override { map = new Map(10, 1, false, MODULO_HASH); };
     void TearDown() override { delete map; }
 };
 
@@ -86,6 +107,475 @@ TEST_F(ThreadlessTest, Lookup) {
     EXPECT_EQ(map->lookup(1), "");  // Lookup non-existing in null bucket
 }
 
+TEST_F(ThreadlessTest, Grows) {
+    int numKeys = 100000;
+    for (int i = 0; i < numKeys; i++) {
+        EXPECT_TRUE(map->insert(i, to_string(i)));
+    }
+    for (int i = 0; i < numKeys; i += 2) {
+        EXPECT_TRUE(map->remove(i));
+    }
+    for (int i = 0; i < numKeys; i++) {
+        EXPECT_EQ(map->lookup(i), i % 2 == 0 ? "" : to_string(i));
+    }
+}
+
+TEST(GrowthTest, IncrementalMatchesWholeRehash) {
+    // Keys congruent modulo the stride, like the keys of one ConcurrentMap bucket
+    int keyStride = 1000;
+    Map control(1);
+    Map treat(1, keyStride, true);
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    for (int i = 0; i < 200000; i++) {
+        int key = (int)(randGen() % 20000) * keyStride + 7;
+        string value = to_string(i);
+
+        switch (randGen() % 3) {
+            case 0:
+                ASSERT_EQ(treat.insert(key, value), control.insert(key, value)) << "at " << i;
+                break;
+            case 1:
+                ASSERT_EQ(treat.lookup(key), control.lookup(key)) << "at " << i;
+                break;
+            case 2:
+                // Removes are rarer so the map keeps growing
+                if (randGen() % 2 == 0) {
+                    ASSERT_EQ(treat.remove(key), control.remove(key)) << "at " << i;
+                }
+                break;
+        }
+    }
+}
+
+TEST(AllocatorTest, SlabReusesReleasedObjects) {
+    Slab<Node> slab;
+    Node* first = slab.allocate();
+    Node* second = slab.allocate();
+    EXPECT_NE(first, second);
+
+    slab.release(first);
+    EXPECT_EQ(slab.allocate(), first);
+
+    // Enough objects to need several blocks
+    vector<Node*> allocated;
+    for (int i = 0; i < 5000; i++) {
+        allocated.push_back(slab.allocate());
+    }
+    sort(allocated.begin(), allocated.end());
+    EXPECT_EQ(unique(allocated.begin(), allocated.end()), allocated.end());
+}
+
+TEST(AllocatorTest, MapValuesSurviveChurn) {
+    Map map(16);
+    // Values of every size up to several arena chunks, inserted and removed in waves so chunks
+    // empty out and are freed while other values still live in later chunks
+    for (int round = 0; round < 20; round++) {
+        for (int key = 0; key < 2000; key++) {
+            string value(key % 97 + round, 'a' + key % 26);
+            if (key % 500 == 0) value = string(100000, 'z');
+            EXPECT_TRUE(map.insert(key, value));
+        }
+        for (int key = round % 2; key < 2000; key += 2) {
+            EXPECT_TRUE(map.remove(key));
+        }
+        for (int key = 0; key < 2000; key++) {
+            string expected = key % 500 == 0 ? string(100000, 'z')
+                                             : string(key % 97 + round, 'a' + key % 26);
+            EXPECT_EQ(map.lookup(key), key % 2 == round % 2 ? "" : expected);
+        }
+        for (int key = 1 - round % 2; key < 2000; key += 2) {
+            EXPECT_TRUE(map.remove(key));
+        }
+    }
+}
+
+TEST(AllocatorTest, ShortValuesStayInNodes) {
+    // Short values take no arena space, so they use as much memory as empty ones
+    Map empty(1024), shortValues(1024), longValues(1024);
+    for (int i = 0; i < 1000; i++) {
+        empty.insert(i, "");
+        shortValues.insert(i, string(MAX_INLINE_VALUE_LENGTH, 'a' + i % 26));
+        longValues.insert(i, string(MAX_INLINE_VALUE_LENGTH + 1, 'a' + i % 26));
+    }
+    map_stats_t emptyStats = {}, shortStats = {}, longStats = {};
+    empty.addStats(&emptyStats);
+    shortValues.addStats(&shortStats);
+    longValues.addStats(&longStats);
+    EXPECT_EQ(shortStats.memoryBytes, emptyStats.memoryBytes);
+    EXPECT_GT(longStats.memoryBytes, emptyStats.memoryBytes + 1000 * MAX_INLINE_VALUE_LENGTH);
+
+    // Views point at the stored bytes on either side of the limit
+    const char* value;
+    size_t length;
+    ASSERT_TRUE(shortValues.lookup(27, &value, &length));
+    EXPECT_EQ(string(value, length), string(MAX_INLINE_VALUE_LENGTH, 'b'));
+    ASSERT_TRUE(longValues.lookup(27, &value, &length));
+    EXPECT_EQ(string(value, length), string(MAX_INLINE_VALUE_LENGTH + 1, 'b'));
+    EXPECT_FALSE(longValues.lookup(1000, &value, &length));
+
+    ConcurrentMap map;
+    string found = "stale";
+    EXPECT_FALSE(map.lookupAndPost(5, &found, nullptr));
+    EXPECT_EQ(found, "");
+    map.insertAndPost(5, "asdf", nullptr);
+    EXPECT_TRUE(map.lookupAndPost(5, &found, nullptr));
+    EXPECT_EQ(found, "asdf");
+}
+
+TEST(FlatMapTest, MatchesChainedMap) {
+    Map control(1000);
+    FlatMap treat(8);
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    // Few enough keys that runs collide often, with values on both sides of the inline size
+    for (int i = 0; i < 200000; i++) {
+        int key = (int)(randGen() % 4000) - 2000;
+        string value = string(randGen() % (2 * INLINE_VALUE_BYTES), 'v') + to_string(i);
+
+        switch (randGen() % 3) {
+            case 0:
+                ASSERT_EQ(treat.insert(key, value), control.insert(key, value)) << "at " << i;
+                break;
+            case 1:
+                ASSERT_EQ(treat.lookup(key), control.lookup(key)) << "at " << i;
+                break;
+            case 2:
+                ASSERT_EQ(treat.remove(key), control.remove(key)) << "at " << i;
+                break;
+        }
+    }
+
+    for (int key = -2000; key < 2000; key++) {
+        EXPECT_EQ(treat.lookup(key), control.lookup(key));
+    }
+}
+
+TEST(FlatMapTest, GrowsAndShrinksRuns) {
+    FlatMap map(8);
+    int numKeys = 1 << 16;
+    for (int i = 0; i < numKeys; i++) {
+        EXPECT_TRUE(map.insert(i * 1000, "value " + to_string(i)));
+    }
+    EXPECT_EQ(map.size(), numKeys);
+
+    // Removing every other key shifts the rest of each run back
+    for (int i = 0; i < numKeys; i += 2) {
+        EXPECT_TRUE(map.remove(i * 1000));
+    }
+    for (int i = 0; i < numKeys; i++) {
+        EXPECT_EQ(map.lookup(i * 1000), i % 2 == 0 ? "" : "value " + to_string(i));
+    }
+    EXPECT_EQ(map.size(), numKeys / 2);
+}
+
+TEST(StatsTest, ShowsChainLengths) {
+    // Sequential keys fill every bucket once
+    Map sequential(1000, 1, false, MODULO_HASH);
+    for (int i = 0; i < 1000; i++) sequential.insert(i, "asdf");
+    map_stats_t stats = {};
+    sequential.addStats(&stats);
+    EXPECT_EQ(stats.size, 1000);
+    EXPECT_EQ(stats.numBuckets, 1000);
+    EXPECT_EQ(stats.emptyBuckets, 0);
+    EXPECT_EQ(stats.longestChain, 1);
+    EXPECT_EQ(stats.chainLengths[1], 1000);
+    EXPECT_GT(stats.memoryBytes, 1000 * sizeof(Node));
+
+    // Keys strided by the bucket count all land in one bucket
+    Map strided(1000, 1, false, MODULO_HASH);
+    for (int i = 0; i < 1000; i++) strided.insert(i * 1000, "asdf");
+    stats = {};
+    strided.addStats(&stats);
+    EXPECT_EQ(stats.emptyBuckets, 999);
+    EXPECT_EQ(stats.longestChain, 1000);
+    EXPECT_EQ(stats.chainLengths[0], 999);
+    EXPECT_EQ(stats.chainLengths[MAX_CHAIN_LENGTH_COUNTED], 1);
+
+    // Flat tables mix the key, so the same keys spread out
+    FlatMap flat(1000);
+    for (int i = 0; i < 1000; i++) flat.insert(i * 1000, "asdf");
+    stats = {};
+    flat.addStats(&stats);
+    EXPECT_EQ(stats.size, 1000);
+    long chainedBuckets = 0;
+    for (long numBuckets : stats.chainLengths) chainedBuckets += numBuckets;
+    EXPECT_EQ(chainedBuckets, stats.numBuckets);
+    EXPECT_EQ(stats.emptyBuckets, stats.numBuckets - 1000);
+    EXPECT_LT(stats.longestChain, 100);
+
+    ConcurrentMap concurrent(100, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, MODULO_HASH);
+    for (int i = 0; i < 1000; i++) concurrent.insertAndPost(i * 100, "asdf", nullptr);
+    for (int i = 1; i < 10; i++) concurrent.insertAndPost(i, "asdf", nullptr);
+    stats = concurrent.stats();
+    EXPECT_EQ(stats.size, 1009);
+    EXPECT_EQ(stats.numSegments, 100);
+    EXPECT_EQ(stats.emptySegments, 90);
+    EXPECT_EQ(stats.largestSegment, 1000);
+}
+
+TEST(StatsTest, MixedHashSpreadsStridedKeys) {
+    // Multiples of 1024 share their low 10 bits, which a mask would keep
+    Map map(1000);
+    for (int i = 0; i < 1000; i++) map.insert(i * 1024, "asdf");
+    map_stats_t stats = {};
+    map.addStats(&stats);
+    EXPECT_EQ(stats.numBuckets, 1024);
+    EXPECT_LT(stats.longestChain, 10);
+    EXPECT_GT(stats.chainLengths[1], 300);
+
+    ConcurrentMap concurrent(1000);
+    for (int i = -5000; i < 5000; i++) concurrent.insertAndPost(i * 1024, "asdf", nullptr);
+    stats = concurrent.stats();
+    EXPECT_EQ(stats.size, 10000);
+    EXPECT_EQ(stats.numSegments, 1024);
+    EXPECT_LT(stats.emptySegments, 20);
+    EXPECT_LT(stats.largestSegment, 40);
+    for (int i = -5000; i < 5000; i++) {
+        ASSERT_EQ(concurrent.lookupAndPost(i * 1024, nullptr), "asdf") << "key " << i * 1024;
+    }
+
+    ConcurrentMap modulo(1000, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, MODULO_HASH);
+    for (int i = -5000; i < 5000; i++) modulo.insertAndPost(i * 1024, "asdf", nullptr);
+    stats = modulo.stats();
+    EXPECT_EQ(stats.size, 10000);
+    // 1024 and 1000 share a factor of 8, so only one segment in 8 is used
+    EXPECT_EQ(stats.emptySegments, 875);
+}
+
+TEST(SnapshotTest, RestoresMap) {
+    string pathSnapshot = "mapper-test-snapshot.bin";
+
+    ConcurrentMap control;
+    for (int i = -2000; i < 2000; i++) {
+        // Long values are kept out of line by flat tables
+        control.insertAndPost(i * 1024, string(i % 40 + 40, 'a' + i % 26), nullptr);
+    }
+    for (int i = -2000; i < 2000; i += 3) control.removeAndPost(i * 1024, nullptr);
+    EXPECT_TRUE(writeSnapshot(&control, pathSnapshot));
+    EXPECT_NE(access((pathSnapshot + ".tmp").c_str(), F_OK), 0);
+
+    // A snapshot that can't be written leaves the old one in place
+    ASSERT_EQ(mkdir((pathSnapshot + ".tmp").c_str(), 0755), 0);
+    ConcurrentMap empty;
+    EXPECT_FALSE(writeSnapshot(&empty, pathSnapshot));
+    rmdir((pathSnapshot + ".tmp").c_str());
+    EXPECT_FALSE(writeSnapshot(&empty, "mapper-test-missing/snapshot.bin"));
+
+    // The snapshot doesn't depend on how the map was laid out
+    ConcurrentMap restored(100, 0, FLAT_BACKEND, SEMAPHORE_LOCK, 0, MODULO_HASH);
+    EXPECT_TRUE(readSnapshot(pathSnapshot, &restored));
+    EXPECT_EQ(restored.stats().size, control.stats().size);
+    for (int i = -2000; i < 2000; i++) {
+        int key = i * 1024;
+        ASSERT_EQ(restored.lookupAndPost(key, nullptr), control.lookupAndPost(key, nullptr))
+            << "key " << key;
+    }
+
+    // A run can save the map it leaves behind
+    string pathInput = "mapper-test-input.txt";
+    string pathOutput = "mapper-test-output.txt";
+    ofstream fileInput(pathInput);
+    fileInput << "N 2\nI 5 \"five\"\nD 2048\n";
+    fileInput.close();
+    ConcurrentMap* run = new ConcurrentMap();
+    EXPECT_TRUE(readSnapshot(pathSnapshot, run));
+    EXPECT_TRUE(executeFile(pathInput, pathOutput, PARTITIONED_MODE, run, pathSnapshot));
+    ConcurrentMap rerun;
+    EXPECT_TRUE(readSnapshot(pathSnapshot, &rerun));
+    EXPECT_EQ(rerun.lookupAndPost(5, nullptr), "five");
+    EXPECT_EQ(rerun.lookupAndPost(2048, nullptr), "");
+    EXPECT_EQ(rerun.stats().size, control.stats().size);
+
+    // A run whose output can't be written isn't saved
+    string pathUnsaved = "mapper-test-unsaved.bin";
+    for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE}) {
+        EXPECT_FALSE(executeFile(pathInput, "/dev/full", mode, nullptr, pathUnsaved));
+        EXPECT_NE(access(pathUnsaved.c_str(), F_OK), 0);
+    }
+
+    // Large snapshots are split across threads
+    ConcurrentMap large;
+    for (int i = 0; i < 300000; i++) large.insertAndPost(i, to_string(i), nullptr);
+    EXPECT_TRUE(writeSnapshot(&large, pathSnapshot));
+    ConcurrentMap loaded(5000, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, MODULO_HASH);
+    loaded.insertAndPost(7, "kept", nullptr);
+    EXPECT_TRUE(readSnapshot(pathSnapshot, &loaded, 4));
+    EXPECT_EQ(loaded.stats().size, 300000);
+    EXPECT_EQ(loaded.lookupAndPost(7, nullptr), "kept");
+    for (int i = 0; i < 300000; i += 997) {
+        ASSERT_EQ(loaded.lookupAndPost(i, nullptr), to_string(i)) << "key " << i;
+    }
+
+    // Truncated snapshots are rejected before anything is inserted
+    EXPECT_EQ(truncate(pathSnapshot.c_str(), 1 << 20), 0);
+    ConcurrentMap truncated;
+    EXPECT_FALSE(readSnapshot(pathSnapshot, &truncated, 4));
+    EXPECT_EQ(truncated.stats().size, 0);
+    EXPECT_FALSE(readSnapshot(pathInput, &truncated));
+
+    // So are snapshots whose count is more than their entries
+    EXPECT_TRUE(writeSnapshot(&control, pathSnapshot));
+    fstream countedFile(pathSnapshot, ios::in | ios::out | ios::binary);
+    uint64_t numEntries;
+    countedFile.seekg(8);
+    countedFile.read((char*)&numEntries, sizeof(numEntries));
+    numEntries++;
+    countedFile.seekp(8);
+    countedFile.write((char*)&numEntries, sizeof(numEntries));
+    countedFile.close();
+    EXPECT_FALSE(readSnapshot(pathSnapshot, &truncated));
+    EXPECT_EQ(truncated.stats().size, 0);
+
+    remove(pathSnapshot.c_str());
+    remove(pathInput.c_str());
+    remove(pathOutput.c_str());
+}
+
+TEST(ParseTest, Instructions) {
+    operation_t opp;
+    string insert = "I -42 \"a \"b\"\"";
+    EXPECT_TRUE(parse(insert.data(), insert.length(), &opp));
+    EXPECT_EQ(opp.type, INSERT);
+    EXPECT_EQ(opp.key, -42);
+    EXPECT_EQ(string(opp.value, opp.valueLength), "a \"b\"");
+
+    string lookup = "L 2147483647";
+    EXPECT_TRUE(parse(lookup.data(), lookup.length(), &opp));
+    EXPECT_EQ(opp.type, LOOKUP);
+    EXPECT_EQ(opp.key, 2147483647);
+
+    string remove = "D -2147483648";
+    EXPECT_TRUE(parse(remove.data(), remove.length(), &opp));
+    EXPECT_EQ(opp.type, DELETE);
+    EXPECT_EQ(opp.key, -2147483648);
+
+    // Only the line's bytes are read, not the rest of the buffer
+    string threads = "N 16\nL 1";
+    EXPECT_TRUE(parse(threads.data(), 4, &opp));
+    EXPECT_EQ(opp.type, THREADS);
+    EXPECT_EQ(opp.key, 16);
+}
+
+TEST(ParseTest, MalformedLines) {
+    operation_t opp;
+    for (string line : {"", "L", "L ", "L1", "X 1", "L -", "L 1 ", "L 1x", "L 2147483648",
+                        "D -2147483649", "I 1", "I 1 ", "I 1 \"", "I 1 asdf", "I 1 \"asdf"}) {
+        EXPECT_FALSE(parse(line.data(), line.length(), &opp)) << "for line \"" << line << "\"";
+    }
+
+    string threads = "N 0";
+    EXPECT_EQ(parseThreadCount(threads.data(), threads.length()), -1);
+}
+
+TEST(WorkloadTest, SeededAndSkewed) {
+    workload_t workload = defaultWorkload();
+    workload.distribution = ZIPF_KEYS;
+    workload.insertPercent = 50;
+    workload.lookupPercent = 30;
+
+    // The same seed generates the same instructions
+    vector<operation_t> opps = generateOperations(workload, 20000);
+    vector<operation_t> again = generateOperations(workload, 20000);
+    EXPECT_EQ(formatInstructions(&opps, 1), formatInstructions(&again, 1));
+
+    vector<int> keyCounts(workload.numKeys);
+    int numInserts = 0;
+    for (operation_t opp : opps) {
+        ASSERT_GE(opp.key, 0);
+        ASSERT_LT(opp.key, workload.numKeys);
+        keyCounts[opp.key]++;
+        if (opp.type == INSERT) numInserts++;
+    }
+    EXPECT_NEAR(numInserts, 10000, 500);
+    // The hottest key takes far more than its uniform share
+    EXPECT_GT(*max_element(keyCounts.begin(), keyCounts.end()), 20 * 20000 / workload.numKeys);
+
+    // Every single bucket key lands in the same segment under either hash, and in the same bucket
+    // of it under the mixed hash
+    workload.distribution = SINGLE_BUCKET_KEYS;
+    for (hash_policy_t hashPolicy : {MIX_HASH, MODULO_HASH}) {
+        workload.hashPolicy = hashPolicy;
+        ASSERT_TRUE(workloadFits(&workload));
+        ConcurrentMap map(workload.numBuckets, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, hashPolicy);
+        for (operation_t opp : generateOperations(workload, 20000)) {
+            map.insertAndPost(opp.key, "a", 1, nullptr);
+        }
+
+        map_stats_t stats = map.stats();
+        EXPECT_GT(stats.size, 900);
+        EXPECT_EQ(stats.largestSegment, stats.size);
+        if (hashPolicy == MIX_HASH) {
+            EXPECT_EQ(stats.longestChain, stats.size);
+        }
+    }
+
+    workload.hashPolicy = MIX_HASH;
+    workload.numKeys = 1 << 30;
+    EXPECT_FALSE(workloadFits(&workload));
+    // Multiples of the bucket count overflow long before the keys run out of bits
+    workload.hashPolicy = MODULO_HASH;
+    EXPECT_FALSE(workloadFits(&workload));
+    workload.numKeys = INT_MAX / workload.numBuckets;
+    EXPECT_TRUE(workloadFits(&workload));
+    workload.numKeys += 2;
+    EXPECT_FALSE(workloadFits(&workload));
+}
+
+TEST(OutputTest, FormatsIntegers) {
+    OutputBuffer output;
+    for (int value : {0, 7, -7, 1000000, INT_MAX, INT_MIN}) {
+        output.appendInt(value);
+        output.append(" ");
+    }
+    EXPECT_EQ(string(output.data(), output.size()),
+              "0 7 -7 1000000 " + to_string(INT_MAX) + " " + to_string(INT_MIN) + " ");
+
+    // Clearing keeps the capacity for the next output
+    output.clear();
+    output.append("a");
+    EXPECT_EQ(string(output.data(), output.size()), "a");
+}
+
+TEST(OutputTest, WritesManyBuffersToFile) {
+    string path = "mapper-test-output.txt";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(fd, -1);
+
+    // More buffers than one writev takes
+    vector<string> lines;
+    for (int i = 0; i < 5000; i++) {
+        lines.push_back(to_string(i) + "\n");
+    }
+    vector<iovec> buffers;
+    for (string& line : lines) {
+        buffers.push_back({(void*)line.data(), line.length()});
+    }
+    output_sink_t sink = {fd, nullptr, false};
+    EXPECT_TRUE(writeOutput(&sink, buffers.data(), buffers.size()));
+    close(fd);
+
+    stringstream expected;
+    for (string& line : lines) {
+        expected << line;
+    }
+    stringstream written;
+    written << ifstream(path).rdbuf();
+    EXPECT_EQ(written.str(), expected.str());
+
+    // Failed writes are reported
+    output_sink_t full = {open("/dev/full", O_WRONLY), nullptr, false};
+    ASSERT_NE(full.fd, -1);
+    EXPECT_FALSE(writeOutput(&full, "a", 1));
+    close(full.fd);
+
+    remove(path.c_str());
+}
+
 TEST(ThreadedTest, StressTest) {
     stringstream treatInputStream;
     treatInputStream << "N 10\n";
@@ -419,3 +909,821 @@ TEST(ThreadedTest, MapRandomKeyScaling) {
     // 2 consumers is 1.5 times faster than 1 consumer
     EXPECT_GT((double)msExec1C / (double)msExec2C, 1.5);
 }
+
+TEST(ThreadedTest, Output) {
+    stringstream inputStream;
+    inputStream << "N 2\n";
+    inputStream << "I 1 \"asdf\"\n";
+    inputStream << "I 1 \"qwer\"\n";
+    inputStream << "L 1\n";
+    inputStream << "D 1\n";
+    inputStream << "D 1\n";
+    inputStream << "L 1\n";
+
+    stringstream expected;
+    expected << "Using 2 threads to consume\n";
+    expected << "[Success] inserted asdf at 1\n";
+    expected << "[Error] failed to insert 1 at qwer\n";
+    expected << "[Success] Found \"asdf\" from key 1\n";
+    expected << "[Success] removed 1\n";
+    expected << "[Error] failed to remove 1: value not found\n";
+    expected << "[Error] failed to locate 1\n";
+
+    stringstream sequencedInput(inputStream.str());
+    stringstream partitionedInput(inputStream.str());
+    EXPECT_EQ(executeStream(&sequencedInput).str(), expected.str());
+    EXPECT_EQ(executeStream(&partitionedInput, new ConcurrentMap(), PARTITIONED_MODE).str(),
+              expected.str());
+}
+
+TEST(ThreadedTest, MalformedLineOutput) {
+    stringstream inputStream;
+    inputStream << "N 2\n";
+    inputStream << "I 1 \"asdf\"\n";
+    inputStream << "L one\n";
+    inputStream << "L 1\n";
+    inputStream << "I 2 asdf\n";
+
+    stringstream expected;
+    expected << "Using 2 threads to consume\n";
+    expected << "[Success] inserted asdf at 1\n";
+    expected << "[Error] malformed instruction on line 3\n";
+    expected << "[Success] Found \"asdf\" from key 1\n";
+    expected << "[Error] malformed instruction on line 5\n";
+
+    stringstream sequencedInput(inputStream.str());
+    EXPECT_EQ(executeStream(&sequencedInput).str(), expected.str());
+
+    // Line numbers must hold across chunks that are parsed out of order
+    string input = inputStream.str();
+    for (size_t chunkBytes : {1, 8, 1 << 20}) {
+        EXPECT_EQ(
+            executeBufferPartitioned(input.data(), input.size(), new ConcurrentMap(), chunkBytes)
+                .str(),
+            expected.str())
+            << "with " << chunkBytes << " byte chunks";
+    }
+
+    stringstream badThreadCount("N x\nL 1\n");
+    EXPECT_EQ(executeStream(&badThreadCount).str(), MALFORMED_THREAD_COUNT);
+}
+
+TEST(ThreadedTest, BlankLineOutput) {
+    stringstream inputStream;
+    inputStream << "N 2\n";
+    inputStream << "I 1 \"a\"\n";
+    inputStream << "\n";
+    inputStream << "L 1\n";
+    inputStream << "L one\n";
+
+    // Blank lines are skipped, but still count for line numbers
+    stringstream expected;
+    expected << "Using 2 threads to consume\n";
+    expected << "[Success] inserted a at 1\n";
+    expected << "[Success] Found \"a\" from key 1\n";
+    expected << "[Error] malformed instruction on line 5\n";
+
+    for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE, KEYED_MODE}) {
+        stringstream input(inputStream.str());
+        EXPECT_EQ(executeStream(&input, new ConcurrentMap(), mode).str(), expected.str())
+            << "in mode " << mode;
+    }
+}
+
+TEST(ThreadedTest, FlatBackendOutput) {
+    stringstream inputStream;
+    inputStream << "N 4\n";
+    for (int i = 0; i < 20000; i++) {
+        inputStream << "I " << i % 700 << " \"a longer value " << i << "\"\n";
+        inputStream << "L " << i % 500 << "\n";
+        inputStream << "D " << i % 300 << "\n";
+    }
+
+    stringstream controlInput(inputStream.str());
+    string control = executeStream(&controlInput).str();
+
+    for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE, KEYED_MODE}) {
+        stringstream treatInput(inputStream.str());
+        EXPECT_EQ(executeStream(&treatInput, new ConcurrentMap(1000, 0, FLAT_BACKEND), mode).str(),
+                  control);
+    }
+}
+
+TEST(ThreadedTest, PartitionedMatchesSequenced) {
+    stringstream treatInputStream;
+    treatInputStream << "N 8\n";
+
+    stringstream controlInputStream;
+    controlInputStream << "N 1\n";
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    int numOpp = 100000;
+    for (int i = 0; i < numOpp; i++) {
+        int opp = randGen() % 3;
+        int key = randGen() % 1000;
+
+        if (opp == 0) {
+            treatInputStream << "I " << key << " \"" << i << "\"\n";
+            controlInputStream << "I " << key << " \"" << i << "\"\n";
+        } else if (opp == 1) {
+            treatInputStream << "L " << key << "\n";
+            controlInputStream << "L " << key << "\n";
+        } else if (opp == 2) {
+            treatInputStream << "D " << key << "\n";
+            controlInputStream << "D " << key << "\n";
+        }
+    }
+
+    stringstream treatOutput =
+        executeStream(&treatInputStream, new ConcurrentMap(), PARTITIONED_MODE);
+    stringstream controlOutput = executeStream(&controlInputStream);
+
+    EXPECT_TRUE(isOutputEqualWithoutThreadCount(&treatOutput, &controlOutput));
+}
+
+TEST(ThreadedTest, KeyedMatchesSequenced) {
+    stringstream inputStream;
+    // More consumers than cores, so some wait for their key's turn while asleep
+    inputStream << "N 16\n";
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    int numOpp = 100000;
+    for (int i = 0; i < numOpp; i++) {
+        int opp = randGen() % 3;
+        // A few hot keys make long chains that still run next to the rest
+        int key = randGen() % 2 == 0 ? randGen() % 4 : randGen() % 1000;
+
+        if (i % 10000 == 0) {
+            inputStream << "bad\n";
+        } else if (opp == 0) {
+            inputStream << "I " << key << " \"" << i << "\"\n";
+        } else if (opp == 1) {
+            inputStream << "L " << key << "\n";
+        } else if (opp == 2) {
+            inputStream << "D " << key << "\n";
+        }
+    }
+
+    stringstream controlInput(inputStream.str());
+    string control = executeStream(&controlInput).str();
+
+    stringstream treatInput(inputStream.str());
+    stringstream treatOutput;
+    output_sink_t outputSink = {-1, &treatOutput, false};
+    ConcurrentMap map;
+    parallelism_t parallelism;
+    executeStream(&treatInput, &map, &outputSink, KEYED_MODE, &parallelism);
+
+    EXPECT_EQ(treatOutput.str(), control);
+    EXPECT_EQ(parallelism.numOpps, (unsigned long)(numOpp - numOpp / 10000));
+    EXPECT_EQ(parallelism.numKeys, 1000u);
+    EXPECT_GT(parallelism.longestChain, (unsigned long)numOpp / 10);
+    EXPECT_LT(parallelism.longestChain, (unsigned long)numOpp / 6);
+}
+
+TEST(KeyChainsTest, OnlyWaitsForSameKey) {
+    KeyChains chains;
+    key_turn_t first = chains.add(1);
+    key_turn_t second = chains.add(1);
+    key_turn_t other = chains.add(2);
+
+    // Would wait forever if it waited for the earlier operations on key 1
+    chains.waitForTurn(other);
+    chains.finish(other);
+
+    chains.waitForTurn(first);
+    chains.finish(first);
+    chains.waitForTurn(second);
+    chains.finish(second);
+
+    parallelism_t parallelism = chains.getParallelism();
+    EXPECT_EQ(parallelism.numOpps, 3u);
+    EXPECT_EQ(parallelism.numKeys, 2u);
+    EXPECT_EQ(parallelism.longestChain, 2u);
+
+    stringstream output;
+    writeParallelism(&output, &parallelism);
+    EXPECT_EQ(output.str(), "operations=3 keys=2 longest_chain=2 parallelism=1.5\n");
+}
+
+TEST(KeyChainsTest, DropsFinishedChains) {
+    KeyChains chains;
+    key_turn_t held = chains.add(-1);
+    for (int key = 0; key < 100000; key++) {
+        key_turn_t turn = chains.add(key);
+        chains.waitForTurn(turn);
+        chains.finish(turn);
+    }
+
+    // The held chain survives every sweep, and a dropped key starts over
+    key_turn_t next = chains.add(-1);
+    EXPECT_EQ(next.index, 1u);
+    EXPECT_EQ(chains.add(0).index, 0u);
+    EXPECT_LE(chains.getNumChains(), 64u);
+    chains.finish(held);
+    chains.waitForTurn(next);
+    chains.finish(next);
+
+    // Every key is counted, however many there are
+    parallelism_t parallelism = chains.getParallelism();
+    EXPECT_EQ(parallelism.numOpps, 100003u);
+    EXPECT_EQ(parallelism.numKeys, 100001u);
+    EXPECT_EQ(parallelism.longestChain, 2u);
+}
+
+struct reorder_producer_args_t {
+    ReorderBuffer* reorderBuffer;
+    int first;
+    int step;
+    int count;
+};
+
+void* putReversedThread(void* uncastArgs) {
+    reorder_producer_args_t* args = (reorder_producer_args_t*)uncastArgs;
+    // Put each group of results backwards so the buffer always fills out of order
+    for (int group = 0; group < args->count; group += 8) {
+        for (int i = min(group + 8, args->count) - 1; i >= group; i--) {
+            int index = args->first + i * args->step;
+            OutputBuffer result;
+            result.appendInt(index);
+            result.append("\n");
+            args->reorderBuffer->put(index, &result);
+        }
+    }
+    return 0;
+}
+
+TEST(ThreadedTest, ReorderBufferOutputsInOrder) {
+    int numThreads = 4;
+    int perThread = 10000;
+    // Smaller than the number of results so producers have to wait for the writer
+    ReorderBuffer reorderBuffer(64);
+
+    vector<pthread_t> threads(numThreads);
+    vector<reorder_producer_args_t> args(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        args[i] = {&reorderBuffer, i, numThreads, perThread};
+        pthread_create(&threads[i], nullptr, putReversedThread, &args[i]);
+    }
+    reorderBuffer.close(numThreads * perThread);
+
+    stringstream output;
+    reorderBuffer.drain(&output);
+    for (pthread_t& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    stringstream expected;
+    for (int i = 0; i < numThreads * perThread; i++) {
+        expected << i << "\n";
+    }
+    EXPECT_EQ(output.str(), expected.str());
+}
+
+struct sequence_turn_args_t {
+    Sequence* sequence;
+    vector<int>* order;
+    int first;
+    int step;
+    int count;
+};
+
+void* takeTurnsThread(void* args_) {
+    sequence_turn_args_t* args = (sequence_turn_args_t*)args_;
+    for (int i = 0; i < args->count; i++) {
+        int turn = args->first + i * args->step;
+        args->sequence->waitFor(turn);
+        // Holding the first turn gives the other threads time to run out of yields and sleep
+        if (turn == 0) usleep(20000);
+        args->order->push_back(turn);
+        args->sequence->advance();
+    }
+    return 0;
+}
+
+TEST(ThreadedTest, SequenceTakesTurns) {
+    // More threads than cores, so most waiters have to sleep instead of spinning
+    int numThreads = 32;
+    int perThread = 500;
+    Sequence sequence;
+    vector<int> order;
+    countersEnabled = true;
+    unsigned long sleptBefore = counterTotal(WAITS_SLEPT);
+
+    vector<pthread_t> threads(numThreads);
+    vector<sequence_turn_args_t> args(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        args[i] = {&sequence, &order, i, numThreads, perThread};
+        pthread_create(&threads[i], nullptr, takeTurnsThread, &args[i]);
+    }
+    for (pthread_t& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    ASSERT_EQ(order.size(), (size_t)(numThreads * perThread));
+    for (int i = 0; i < numThreads * perThread; i++) {
+        EXPECT_EQ(order[i], i);
+    }
+    EXPECT_EQ(sequence.load(), (unsigned long)(numThreads * perThread));
+    EXPECT_GT(counterTotal(WAITS_SLEPT), sleptBefore);
+    countersEnabled = false;
+}
+
+TEST(ThreadedTest, PartitionedSmallChunks) {
+    stringstream inputStream;
+    inputStream << "N 4\n";
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    int numOpp = 10000;
+    for (int i = 0; i < numOpp; i++) {
+        int opp = randGen() % 3;
+        int key = randGen() % 100;
+
+        if (opp == 0) {
+            inputStream << "I " << key << " \"" << i << "\"\n";
+        } else if (opp == 1) {
+            inputStream << "L " << key << "\n";
+        } else if (opp == 2) {
+            inputStream << "D " << key << "\n";
+        }
+    }
+    string input = inputStream.str();
+
+    stringstream controlInput(input);
+    string control = executeStream(&controlInput).str();
+
+    // Chunks smaller than a line, chunks that split lines, and a chunk for the whole input
+    for (size_t chunkBytes : {1, 7, 64, 4096, 1 << 20}) {
+        string treat =
+            executeBufferPartitioned(input.data(), input.size(), new ConcurrentMap(), chunkBytes)
+                .str();
+        EXPECT_EQ(treat, control) << "with " << chunkBytes << " byte chunks";
+    }
+}
+
+TEST(ThreadedTest, PartitionedSkewedKeys) {
+    // Keys that all share a map bucket still spread over the partitions
+    vector<bool> used(32, false);
+    for (int i = 0; i < 200; i++) {
+        used[partitionOf(i * 1000, used.size())] = true;
+    }
+    EXPECT_GT(count(used.begin(), used.end(), true), 24);
+
+    // One hot key and many keys in one bucket, as in the single bucket sample
+    workload_t workload = defaultWorkload();
+    workload.distribution = ZIPF_KEYS;
+    workload.zipfSkew = 1.5;
+    vector<operation_t> opps = generateOperations(workload, 30000);
+    workload.distribution = SINGLE_BUCKET_KEYS;
+    vector<operation_t> bucketOpps = generateOperations(workload, 30000);
+    opps.insert(opps.end(), bucketOpps.begin(), bucketOpps.end());
+
+    stringstream sequencedInput(formatInstructions(&opps, 4));
+    stringstream partitionedInput(formatInstructions(&opps, 4));
+    EXPECT_EQ(executeStream(&partitionedInput, new ConcurrentMap(), PARTITIONED_MODE).str(),
+              executeStream(&sequencedInput).str());
+}
+
+TEST(ThreadedTest, PartitionedBulkOperations) {
+    // A long run of inserts with repeated keys, then operations that depend on it
+    stringstream inputStream;
+    inputStream << "N 3\n";
+    for (int i = 0; i < 50000; i++) {
+        inputStream << "I " << (i % 40000) * 1024 << " \"value " << i << "\"\n";
+    }
+    for (int i = 0; i < 20000; i++) {
+        inputStream << "L " << i * 1024 << "\n";
+        inputStream << "D " << i * 2048 << "\n";
+        inputStream << "I " << i * 2048 << " \"again\"\n";
+    }
+
+    stringstream controlInput(inputStream.str());
+    string control = executeStream(&controlInput).str();
+
+    countersEnabled = true;
+    unsigned long locksBefore = counterTotal(BUCKET_LOCKS);
+    string input = inputStream.str();
+    for (size_t chunkBytes : {1 << 10, 1 << 20}) {
+        EXPECT_EQ(
+            executeBufferPartitioned(input.data(), input.size(), new ConcurrentMap(), chunkBytes)
+                .str(),
+            control)
+            << "with " << chunkBytes << " byte chunks";
+    }
+    // The operations in 1 MB chunks share most of their locks
+    EXPECT_LT(counterTotal(BUCKET_LOCKS) - locksBefore, 2 * 110000u);
+    countersEnabled = false;
+
+    // Operations on the same key see each other in the order they were given
+    ConcurrentMap map;
+    bulk_op_type_t types[] = {BULK_LOOKUP, BULK_INSERT, BULK_INSERT, BULK_LOOKUP,
+                              BULK_INSERT, BULK_REMOVE, BULK_REMOVE, BULK_LOOKUP};
+    int keys[] = {7, 7, 7, 7, 8, 7, 7, 8};
+    const char* values[] = {nullptr, "a", "b", nullptr, "c", nullptr, nullptr, nullptr};
+    bulk_op_t opps[8] = {};
+    for (int i = 0; i < 8; i++) {
+        opps[i].type = types[i];
+        opps[i].key = keys[i];
+        if (values[i] != nullptr) {
+            opps[i].value = values[i];
+            opps[i].length = 1;
+        }
+    }
+    map.executeBulk(opps, 8);
+    EXPECT_FALSE(opps[0].succeeded);
+    EXPECT_TRUE(opps[1].succeeded);
+    EXPECT_FALSE(opps[2].succeeded);
+    EXPECT_EQ(opps[3].found, "a");
+    EXPECT_TRUE(opps[4].succeeded);
+    EXPECT_TRUE(opps[5].succeeded);
+    EXPECT_FALSE(opps[6].succeeded);
+    EXPECT_EQ(opps[7].found, "c");
+    EXPECT_EQ(map.lookupAndPost(7, nullptr), "");
+}
+
+TEST(ThreadedTest, ShardedMapMatchesSequenced) {
+    vector<numa_node_t> nodes = readNumaNodes();
+    ASSERT_FALSE(nodes.empty());
+    for (numa_node_t& node : nodes) EXPECT_FALSE(node.cpus.empty());
+
+    stringstream inputStream;
+    inputStream << "N 4\n";
+    for (int i = 0; i < 20000; i++) {
+        inputStream << "I " << i % 700 << " \"asdf\"\n";
+        inputStream << "L " << i % 500 << "\n";
+        inputStream << "D " << i % 300 << "\n";
+    }
+    string input = inputStream.str();
+    stringstream controlInput(input);
+    string control = executeStream(&controlInput).str();
+
+    // More shards than nodes wrap around the nodes, so this runs on a single node machine too.
+    // Workers are pinned to the CPUs of their shard's node.
+    for (int numShards : {2, 3, 8}) {
+        ConcurrentMap* map =
+            new ConcurrentMap(1000, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, MIX_HASH, numShards);
+        EXPECT_EQ(map->shards(), numShards);
+        EXPECT_EQ(executeBufferPartitioned(input.data(), input.size(), map, 1 << 12).str(), control)
+            << "with " << numShards << " shards";
+    }
+
+    // Modulo buckets don't follow the partitions, so that map keeps a single shard
+    ConcurrentMap moduloMap(1000, 0, CHAINED_BACKEND, SEMAPHORE_LOCK, 0, MODULO_HASH, 4);
+    EXPECT_EQ(moduloMap.shards(), 1);
+}
+
+TEST(ThreadedTest, PartitionedFile) {
+    string pathInput = "mapper-test-input.txt";
+    string pathSequenced = "mapper-test-sequenced.txt";
+    string pathPartitioned = "mapper-test-partitioned.txt";
+
+    ofstream fileInput(pathInput);
+    fileInput << "N 3\n";
+    for (int i = 0; i < 30000; i++) {
+        fileInput << "I " << i % 700 << " \"asdf\"\n";
+        fileInput << "L " << i % 500 << "\n";
+        fileInput << "D " << i % 300 << "\n";
+    }
+    fileInput.close();
+
+    executeFile(pathInput, pathSequenced, SEQUENCED_MODE);
+    executeFile(pathInput, pathPartitioned, PARTITIONED_MODE);
+
+    stringstream sequenced;
+    sequenced << ifstream(pathSequenced).rdbuf();
+    stringstream partitioned;
+    partitioned << ifstream(pathPartitioned).rdbuf();
+    EXPECT_EQ(partitioned.str(), sequenced.str());
+
+    remove(pathInput.c_str());
+    remove(pathSequenced.c_str());
+    remove(pathPartitioned.c_str());
+}
+
+TEST(ThreadedTest, BinaryMatchesText) {
+    stringstream inputStream;
+    inputStream << "N 3\n";
+    for (int i = 0; i < 3000; i++) {
+        inputStream << "I " << i % 70 << " \"value " << i % 20 << "\"\n";
+        inputStream << "L " << i % 50 << "\n";
+        inputStream << "D " << i % 30 << "\n";
+    }
+    inputStream << "L one\n";
+    inputStream << "L 1\n";
+    string input = inputStream.str();
+
+    stringstream controlInput(input);
+    string control = executeStream(&controlInput).str();
+
+    stringstream textInput(input);
+    stringstream binaryStream;
+    ASSERT_TRUE(convertTextToBinary(&textInput, &binaryStream));
+    string binary = binaryStream.str();
+    binary_instructions_t instructions;
+    ASSERT_TRUE(openBinaryInstructions(binary.data(), binary.size(), &instructions));
+    EXPECT_EQ(instructions.numThreads, 3);
+    EXPECT_EQ(instructions.numOpps, 9002u);
+    EXPECT_EQ(instructions.numInserts, 3000u);
+    // Only inserts carry a value reference, and each distinct value is stored once
+    EXPECT_LT(binary.size(), input.size());
+
+    for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE, KEYED_MODE}) {
+        stringstream output;
+        output_sink_t outputSink = {-1, &output, false};
+        ConcurrentMap map;
+        executeBinary(&instructions, &map, &outputSink, mode);
+        EXPECT_EQ(output.str(), control) << "in mode " << mode;
+    }
+
+    // Chunks that don't divide the instructions evenly
+    for (uint64_t chunkOpps : {1, 7, 4096}) {
+        stringstream output;
+        output_sink_t outputSink = {-1, &output, false};
+        ConcurrentMap map;
+        executeBinaryPartitioned(&instructions, &map, &outputSink, chunkOpps);
+        EXPECT_EQ(output.str(), control) << "with " << chunkOpps << " instruction chunks";
+    }
+
+    // Only the malformed line is lost converting back
+    stringstream text;
+    convertBinaryToText(&instructions, &text);
+    string expectedText = input;
+    expectedText.replace(expectedText.find("L one"), 5, "?");
+    EXPECT_EQ(text.str(), expectedText);
+
+    // A truncated file is rejected
+    EXPECT_FALSE(openBinaryInstructions(binary.data(), binary.size() - 1, &instructions));
+
+    stringstream badThreadCount("N x\nL 1\n");
+    stringstream badThreadCountBinary;
+    ASSERT_TRUE(convertTextToBinary(&badThreadCount, &badThreadCountBinary));
+    binary = badThreadCountBinary.str();
+    ASSERT_TRUE(openBinaryInstructions(binary.data(), binary.size(), &instructions));
+    stringstream output;
+    output_sink_t outputSink = {-1, &output, false};
+    ConcurrentMap map;
+    executeBinary(&instructions, &map, &outputSink, PARTITIONED_MODE);
+    EXPECT_EQ(output.str(), MALFORMED_THREAD_COUNT);
+}
+
+struct pipe_writer_args_t {
+    int fd;
+    string* input;
+    size_t pieceBytes;
+};
+
+// Writes the input in small pieces that split lines, like a slow upstream job
+void* writePipeThread(void* uncastArgs) {
+    pipe_writer_args_t* args = (pipe_writer_args_t*)uncastArgs;
+    for (size_t start = 0; start < args->input->size(); start += args->pieceBytes) {
+        size_t pieceBytes = min(args->pieceBytes, args->input->size() - start);
+        EXPECT_EQ(write(args->fd, args->input->data() + start, pieceBytes), (ssize_t)pieceBytes);
+    }
+    close(args->fd);
+    return 0;
+}
+
+TEST(ThreadedTest, StreamedPipeMatchesSequenced) {
+    stringstream inputStream;
+    inputStream << "N 3\n";
+    for (int i = 0; i < 20000; i++) {
+        inputStream << "I " << i % 700 << " \"asdf\"\n";
+        inputStream << "L " << i % 500 << "\n";
+        if (i % 1000 == 0) inputStream << "X malformed\n";
+        inputStream << "D " << i % 300 << "\n";
+    }
+    string input = inputStream.str();
+    string control = executeStream(&inputStream).str();
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    pipe_writer_args_t args = {fds[1], &input, 1000};
+    pthread_t writer;
+    pthread_create(&writer, nullptr, writePipeThread, &args);
+
+    // Chunks smaller than the pieces written, so reads end partway through lines
+    stringstream output;
+    output_sink_t sink = {-1, &output, false};
+    ConcurrentMap map;
+    executeFdPartitioned(fds[0], &map, &sink, 300);
+    pthread_join(writer, nullptr);
+    close(fds[0]);
+
+    EXPECT_EQ(output.str(), control);
+}
+
+TEST(ThreadedTest, MapperKeepsMapBetweenInputs) {
+    Mapper mapper(3);
+    EXPECT_EQ(mapper.execute("I 5 \"a\"\n"), "[Success] inserted a at 5\n");
+    // Line numbers count from the start of each input
+    EXPECT_EQ(mapper.execute("L 5\nbad\n"),
+              "[Success] Found \"a\" from key 5\n[Error] malformed instruction on line 2\n");
+    EXPECT_EQ(mapper.execute(""), "");
+    EXPECT_EQ(mapper.execute("D 5\n"), "[Success] removed 5\n");
+
+    // Many small inputs give the same output as one file run in order
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+    stringstream controlInput;
+    controlInput << "N 1\n";
+    string treatOutput;
+    for (int input = 0; input < 500; input++) {
+        stringstream inputStream;
+        for (int i = 0; i < 20; i++) {
+            int key = randGen() % 50;
+            inputStream << (i % 3 == 0 ? "I " : i % 3 == 1 ? "L " : "D ") << key;
+            inputStream << (i % 3 == 0 ? " \"asdf\"\n" : "\n");
+        }
+        controlInput << inputStream.str();
+        treatOutput += mapper.execute(inputStream.str());
+    }
+
+    string controlOutput = executeStream(&controlInput).str();
+    EXPECT_EQ(treatOutput, controlOutput.substr(controlOutput.find('\n') + 1));
+}
+
+TEST(ThreadedTest, CountersMatchInput) {
+    stringstream inputStream;
+    inputStream << "N 4\n";
+    for (int i = 0; i < 3000; i++) {
+        inputStream << "I " << i % 70 << " \"asdf\"\n";
+        inputStream << "L " << i % 50 << "\n";
+        inputStream << "D " << i % 30 << "\n";
+    }
+    inputStream << "bad\n";
+
+    countersEnabled = true;
+    for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE, KEYED_MODE}) {
+        unsigned long before[NUM_COUNTERS];
+        for (int i = 0; i < NUM_COUNTERS; i++) before[i] = counterTotal((counter_t)i);
+
+        stringstream treatInput(inputStream.str());
+        executeStream(&treatInput, new ConcurrentMap(), mode);
+
+        EXPECT_EQ(counterTotal(LINES_READ) - before[LINES_READ], 9001u);
+        EXPECT_EQ(counterTotal(INSERTS) - before[INSERTS], 3000u);
+        EXPECT_EQ(counterTotal(LOOKUPS) - before[LOOKUPS], 3000u);
+        EXPECT_EQ(counterTotal(DELETES) - before[DELETES], 3000u);
+        EXPECT_EQ(counterTotal(MALFORMED_LINES) - before[MALFORMED_LINES], 1u);
+        // Every map operation takes one bucket lock, except that partitioned runs of inserts lock
+        // each bucket once
+        if (mode != PARTITIONED_MODE) {
+            EXPECT_EQ(counterTotal(BUCKET_LOCKS) - before[BUCKET_LOCKS], 9000u);
+        } else {
+            EXPECT_LE(counterTotal(BUCKET_LOCKS) - before[BUCKET_LOCKS], 9000u);
+        }
+        EXPECT_GT(counterTotal(EXECUTE_NS), before[EXECUTE_NS]);
+    }
+    countersEnabled = false;
+}
+
+TEST(ThreadedTest, LockStrategiesOutput) {
+    stringstream inputStream;
+    inputStream << "N 4\n";
+
+    std::mt19937 randGen;
+    randGen.seed(time(nullptr));
+
+    for (int i = 0; i < 20000; i++) {
+        int opp = randGen() % 10;
+        int key = randGen() % 500;
+
+        // Mostly lookups so shared locking is exercised
+        if (opp < 2) {
+            inputStream << "I " << key << " \"" << i << "\"\n";
+        } else if (opp < 9) {
+            inputStream << "L " << key << "\n";
+        } else {
+            inputStream << "D " << key << "\n";
+        }
+    }
+
+    stringstream controlInput(inputStream.str());
+    string control = executeStream(&controlInput).str();
+
+    for (lock_strategy_t strategy : {SEMAPHORE_LOCK, SPIN_LOCK, RW_LOCK, OPTIMISTIC_LOCK}) {
+        for (int numStripes : {0, 1, 16}) {
+            for (execution_mode_t mode : {SEQUENCED_MODE, PARTITIONED_MODE, KEYED_MODE}) {
+                stringstream treatInput(inputStream.str());
+                ConcurrentMap* map =
+                    new ConcurrentMap(1000, 0, CHAINED_BACKEND, strategy, numStripes);
+                EXPECT_EQ(executeStream(&treatInput, map, mode).str(), control)
+                    << "with strategy " << strategy << " and " << numStripes << " stripes";
+            }
+        }
+    }
+}
+
+struct lock_benchmark_args_t {
+    ConcurrentMap* map;
+    int numOpp;
+    int seed;
+};
+
+// Runs random operations straight on the map, 70% of them lookups
+void* lookupHeavyThread(void* uncastArgs) {
+    lock_benchmark_args_t* args = (lock_benchmark_args_t*)uncastArgs;
+    std::mt19937 randGen(args->seed);
+
+    for (int i = 0; i < args->numOpp; i++) {
+        int opp = randGen() % 10;
+        int key = randGen() % 100000;
+
+        if (opp < 7) {
+            args->map->lookupAndPost(key, nullptr);
+        } else if (opp < 9) {
+            args->map->insertAndPost(key, "asdf", nullptr);
+        } else {
+            args->map->removeAndPost(key, nullptr);
+        }
+    }
+    return 0;
+}
+
+TEST(ThreadedTest, DISABLED_LockStrategyTimer) {
+    int maxThreads = 8;
+    int numOpp = 1 << 20;
+    const char* strategyNames[] = {"semaphore", "spinlock", "rwlock", "optimistic"};
+
+    for (lock_strategy_t strategy : {SEMAPHORE_LOCK, SPIN_LOCK, RW_LOCK, OPTIMISTIC_LOCK}) {
+        // One lock per bucket, and fewer locks than buckets
+        for (int numStripes : {0, 64}) {
+            for (int threads = 1; threads <= maxThreads; threads *= 2) {
+                ConcurrentMap map(1000, 0, CHAINED_BACKEND, strategy, numStripes);
+
+                vector<pthread_t> threadIds(threads);
+                vector<lock_benchmark_args_t> args(threads);
+
+                chrono::system_clock::time_point begin = chrono::high_resolution_clock::now();
+                for (int i = 0; i < threads; i++) {
+                    args[i] = {&map, numOpp / threads, i};
+                    pthread_create(&threadIds[i], nullptr, lookupHeavyThread, &args[i]);
+                }
+                for (pthread_t& thread : threadIds) {
+                    pthread_join(thread, nullptr);
+                }
+                chrono::system_clock::time_point end = chrono::high_resolution_clock::now();
+
+                int msExec = chrono::duration_cast<chrono::milliseconds>(end - begin).count();
+                cout << "Executed " << numOpp << " operations with " << strategyNames[strategy]
+                     << ", " << (numStripes == 0 ? 1000 : numStripes) << " stripes, and "
+                     << threads << " thread(s) in " << msExec << "ms\n";
+            }
+        }
+    }
+}
+
+struct unlocked_lookup_args_t {
+    ConcurrentMap* map;
+    int numKeys;
+    int numOpp;
+    int seed;
+    bool writer;
+    // Lookups that returned something other than the key's only possible value
+    int numTorn;
+};
+
+// Each key only ever holds its own number, so any other result came from a half-finished write
+void* unlockedLookupThread(void* uncastArgs) {
+    unlocked_lookup_args_t* args = (unlocked_lookup_args_t*)uncastArgs;
+    std::mt19937 randGen(args->seed);
+
+    for (int i = 0; i < args->numOpp; i++) {
+        int key = randGen() % args->numKeys;
+        if (!args->writer) {
+            string value = args->map->lookupAndPost(key, nullptr);
+            if (value != "" && value != to_string(key)) args->numTorn++;
+        } else if (randGen() % 2 == 0) {
+            args->map->insertAndPost(key, to_string(key), nullptr);
+        } else {
+            args->map->removeAndPost(key, nullptr);
+        }
+    }
+    return 0;
+}
+
+TEST(ThreadedTest, UnlockedLookupsDuringWrites) {
+    // Few buckets so each table keeps growing and moving nodes under the readers
+    ConcurrentMap map(4, 0, CHAINED_BACKEND, OPTIMISTIC_LOCK);
+    for (int key = 0; key < 50000; key += 2) {
+        map.insertAndPost(key, to_string(key), nullptr);
+    }
+
+    int numThreads = 4;
+    vector<pthread_t> threads(numThreads);
+    vector<unlocked_lookup_args_t> args(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        args[i] = {&map, 100000, 200000, i, i == 0, 0};
+        pthread_create(&threads[i], nullptr, unlockedLookupThread, &args[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], nullptr);
+        EXPECT_EQ(args[i].numTorn, 0);
+    }
+}
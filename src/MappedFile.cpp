@@ -0,0 +1,48 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(string path) {
+    data = nullptr;
+    length = 0;
+    opened = false;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        close(fd);
+        return;
+    }
+    length = fileStat.st_size;
+
+    // Empty files can't be mapped but are still valid input
+    if (length > 0) {
+        void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return;
+        }
+        // Workers read their chunks front to back
+        madvise(mapping, length, MADV_SEQUENTIAL);
+        data = (const char*)mapping;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    opened = true;
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) munmap((void*)data, length);
+}
+
+bool MappedFile::isOpen() { return opened; }
+
+const char* MappedFile::begin() { return data; }
+
+size_t MappedFile::size() { return length; }
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+  private:
+    const char* data;
+
+    size_t length;
+
+    bool opened;
+
+  public:
+    MappedFile(string path);
+
+    ~MappedFile();
+
+    bool isOpen();
+
+    const char* begin();
+
+    size_t size();
+};
@@ -1,23 +1,38 @@
+#include <fcntl.h>
 #include <semaphore.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "BinaryInstructions.h"
 #include "ConcurrentMap.h"
+#include "Counters.h"
+#include "KeyChains.h"
+#include "MappedFile.h"
+#include "Mapper.h"
+#include "MapperEngine.h"
+#include "Operation.h"
+#include "OutputBuffer.h"
+#include "ReorderBuffer.h"
+#include "Sequence.h"
+#include "Snapshot.h"
 
 using namespace std;
 
+// Number of results consumers can finish ahead of the next line to output
+const int REORDER_BUFFER_LINES = 4096;
+
 // Shared state for consumers and producers
 struct mapper_shared_state_t {
     ConcurrentMap* map;
 
     sem_t semLockRead;
 
-    // Used to automatically output from consumer
-    sem_t semLockOut;
-
     int remainingConsumers;
 
     sem_t semRemainingConsumers;
@@ -31,107 +46,101 @@ struct mapper_shared_state_t {
     // Tracks which line the producer is producing
     long unsigned int currOppReadIndex;
 
-    long unsigned int currOppExecuteIndex;
+    // Blank lines skipped so far, which still count when numbering malformed lines
+    long unsigned int numBlankLines;
 
-    // Tracks which operation to output next
-    long unsigned int oppToOutputIndex;
+    // Line whose turn it is to execute
+    Sequence currOppExecuteIndex;
 
-    stringstream* inputBuffer;
+    // Chains operations by key in keyed mode, so they only wait for their key's turn, or nullptr
+    KeyChains* keyChains;
 
-    stringstream* outputBuffer;
-};
+    istream* inputBuffer;
 
-enum operation_type_t {
-    INSERT,
-    LOOKUP,
-    DELETE,
-};
+    // Binary input, which consumers decode instead of reading lines, or nullptr
+    binary_instructions_t* binary;
 
-struct operation_t {
-    operation_type_t type;
-    int key;
-    string value;
+    // Inserts before the next binary instruction to read, which picks an insert's value
+    uint64_t binaryInsertIndex;
+
+    output_sink_t* outputSink;
+
+    // Consumers drop results here by line number so they can output without waiting their turn
+    ReorderBuffer* reorderBuffer;
 };
 
+// Parses line, or marks opp malformed with the line number of the line at lineIndex
+inline void parseLine(string* line, long unsigned int lineIndex, operation_t* opp) {
+    if (!parse(line->data(), line->length(), opp)) {
+        setInvalid(opp, lineIndex + FIRST_INSTRUCTION_LINE);
+    }
+}
+
+// Adds opp to its key's chain. Called while holding the read lock, so operations join their
+// chains in input order.
+inline key_turn_t joinChain(mapper_shared_state_t* state, operation_t* opp) {
+    if (!isMapOperation(opp)) return {nullptr, 0};
+    return state->keyChains->add(opp->key);
+}
+
+// Reads the next line that isn't blank, which is left empty once the input has ended. lineIndex
+// is set to where the line is in the input, counting blank lines. In keyed mode, the line is also
+// parsed into opp and joins its key's chain at turn.
 inline void readLine(mapper_shared_state_t* state, long unsigned int* lineReadIndex,
-                        string* lineRead) {
-    while (sem_trywait(&state->semLockRead) != 0);
-    getline(*state->inputBuffer, *lineRead);
+                     long unsigned int* lineIndex, string* lineRead, operation_t* opp,
+                     key_turn_t* turn) {
+    unsigned long startTime = startTimer();
+    waitAdaptive(&state->semLockRead);
+    stopTimer(READ_LOCK_WAIT_NS, startTime);
+
+    startTime = startTimer();
+    // getline leaves the line alone once the input has ended, so it is cleared first
+    lineRead->clear();
+    // Blank lines are skipped like partitioned mode skips them, instead of ending the input
+    while (getline(*state->inputBuffer, *lineRead) && lineRead->empty()) {
+        state->numBlankLines++;
+    }
+    stopTimer(READ_NS, startTime);
     // Store a snapshot of the index
     *lineReadIndex = state->currOppReadIndex;
+    *lineIndex = state->currOppReadIndex + state->numBlankLines;
     state->currOppReadIndex++;
-    post(&state->semLockRead);
-}
-
-inline void parse(string line, operation_t* opp) {
-    int keyStart = 2;
-    int keyEnd = keyStart;
-    // Move forward until the end of the line (for Lookup or Delete) or space (for Insert)
-    for (long unsigned int i = keyStart; i <= line.length(); i++) {
-        keyEnd = i;
-        if (i != line.length() && line.at(i) == ' ') {
-            break;
-        }
-    }
-    int keyLen = keyEnd - keyStart;
-    string keyString = line.substr(keyStart, keyLen);
-    opp->key = stoi(keyString);
-
-    switch (line.at(0)) {
-        case 'I':
-            opp->type = INSERT;
-            break;
-        case 'L':
-            opp->type = LOOKUP;
-            break;
-        case 'D':
-            opp->type = DELETE;
-            break;
-    }
-
-    if (opp->type == INSERT) {
-        // Get the value to insert
-        int valueStart = keyEnd + 2;
-        int valueEnd = line.length() - 1;
-        int valueLen = valueEnd - valueStart;
-        opp->value = line.substr(valueStart, valueLen);
+    if (state->keyChains != nullptr && !lineRead->empty()) {
+        startTime = startTimer();
+        parseLine(lineRead, *lineIndex, opp);
+        stopTimer(PARSE_NS, startTime);
+        *turn = joinChain(state, opp);
     }
+    post(&state->semLockRead);
 }
 
 // Run an operation on map and return the output
-inline void executeOperation(mapper_shared_state_t* state, operation_t opp,
-                             string* outputLine) {
+inline void executeOperation(mapper_shared_state_t* state, operation_t* opp,
+                             OutputBuffer* outputLine) {
     // Lock to ensure order of execution.
     // Lock is unlocked from map when it has an internal lock
-    wait(&state->semLockScheduleOpp);
+    unsigned long startTime = startTimer();
+    waitAdaptive(&state->semLockScheduleOpp);
+    stopTimer(SCHEDULE_LOCK_WAIT_NS, startTime);
     // Increment so that next operation can run after lock is released
-    state->currOppExecuteIndex++;
+    state->currOppExecuteIndex.advance();
 
-    if (opp.type == DELETE) {
-        bool success = state->map->removeAndPost(opp.key, &state->semLockScheduleOpp);
-
-        if (success) {
-            *outputLine + "[Success] removed " + to_string(opp.key) + "\n";
-        } else {
-            *outputLine + "[Error] failed to remove " + to_string(opp.key) + ": value not found\n";
-        }
-    } else if (opp.type == LOOKUP) {
-        string value = state->map->lookupAndPost(opp.key, &state->semLockScheduleOpp);
-
-        if (value != "") {
-            *outputLine + "[Success] Found \"" + value + "\" from key " + to_string(opp.key) + "\n";
-        } else {
-            *outputLine + "[Error] failed to locate " + to_string(opp.key) + "\n";
-        }
-    } else if (opp.type == INSERT) {
-        bool success = state->map->insertAndPost(opp.key, opp.value, &state->semLockScheduleOpp);
+    startTime = startTimer();
+    runOperation(state->map, opp, &state->semLockScheduleOpp, outputLine);
+    stopTimer(EXECUTE_NS, startTime);
+}
 
-        if (success) {
-            *outputLine + "[Success] inserted " + opp.value + " at " + to_string(opp.key) + "\n";
-        } else {
-            *outputLine + "[Error] failed to insert " + to_string(opp.key) + " at " + opp.value + "\n";
-        }
-    }
+// Runs an operation once the operation before it on the same key has finished
+inline void executeKeyedOperation(mapper_shared_state_t* state, operation_t* opp, key_turn_t turn,
+                                  OutputBuffer* outputLine) {
+    unsigned long startTime = startTimer();
+    state->keyChains->waitForTurn(turn);
+    stopTimer(TURN_WAIT_NS, startTime);
+
+    startTime = startTimer();
+    runOperation(state->map, opp, nullptr, outputLine);
+    stopTimer(EXECUTE_NS, startTime);
+    state->keyChains->finish(turn);
 }
 
 inline void signalConsumerDone(mapper_shared_state_t*& state) {
@@ -146,95 +155,202 @@ inline void signalConsumerDone(mapper_shared_state_t*& state) {
     post(&state->semRemainingConsumers);
 }
 
-inline void writeToOutput(mapper_shared_state_t*& state, string outputLine) {
-    wait(&state->semLockOut);
-
-    *(state->outputBuffer) << outputLine;
-    state->oppToOutputIndex++;
-
-    post(&state->semLockOut);
-}
-
 // Consumes lines produced by producer and outputs the result
 void* consumeLineThread(void* args) {
     mapper_shared_state_t* state = (mapper_shared_state_t*)args;
-    string outputLine;
+    // Reused for every line so reading and formatting stop allocating once they fit
+    string lineRead;
+    OutputBuffer outputLine;
     operation_t opp;
+    setCounterRole("consumer");
 
     while (true) {
         long unsigned int lineReadIndex;
-        string lineRead;
-        readLine(state, &lineReadIndex, &lineRead);
+        long unsigned int lineIndex;
+        key_turn_t turn;
+        readLine(state, &lineReadIndex, &lineIndex, &lineRead, &opp, &turn);
 
         // If no lines left to read
         if (lineRead == "") {
+            state->reorderBuffer->close(lineReadIndex);
             signalConsumerDone(state);
             return 0;
         }
+        count(LINES_READ);
+
+        if (state->keyChains != nullptr) {
+            executeKeyedOperation(state, &opp, turn, &outputLine);
+            state->reorderBuffer->put(lineReadIndex, &outputLine);
+            continue;
+        }
 
         // Wait for right turn to execute
-        while (lineReadIndex != state->currOppExecuteIndex);
-        parse(lineRead, &opp);
-        executeOperation(state, opp, &outputLine);
+        unsigned long startTime = startTimer();
+        state->currOppExecuteIndex.waitFor(lineReadIndex);
+        stopTimer(TURN_WAIT_NS, startTime);
 
-        // Wait for right turn to output
-        while (lineReadIndex != state->oppToOutputIndex);
-        writeToOutput(state, outputLine);
+        startTime = startTimer();
+        parseLine(&lineRead, lineIndex, &opp);
+        stopTimer(PARSE_NS, startTime);
+        executeOperation(state, &opp, &outputLine);
+
+        state->reorderBuffer->put(lineReadIndex, &outputLine);
     }
 }
 
-void write(stringstream* stream, string pathOutput) {
-    ofstream fileOutput(pathOutput, ifstream::out);
-    fileOutput << stream->rdbuf();
-    fileOutput.flush();
-    fileOutput.close();
+// Consumes binary instructions, which are decoded by index instead of read and parsed
+void* consumeBinaryThread(void* args) {
+    mapper_shared_state_t* state = (mapper_shared_state_t*)args;
+    OutputBuffer outputLine;
+    operation_t opp;
+    setCounterRole("consumer");
+
+    while (true) {
+        unsigned long startTime = startTimer();
+        waitAdaptive(&state->semLockRead);
+        stopTimer(READ_LOCK_WAIT_NS, startTime);
+        long unsigned int oppIndex = state->currOppReadIndex;
+        state->currOppReadIndex++;
+        uint64_t insertIndex = state->binaryInsertIndex;
+        if (isBinaryInsert(state->binary, oppIndex)) state->binaryInsertIndex++;
+        // Keyed instructions join their key's chain in file order, so they are decoded first
+        key_turn_t turn;
+        if (state->keyChains != nullptr && oppIndex < state->binary->numOpps) {
+            startTime = startTimer();
+            decodeOperation(state->binary, oppIndex, insertIndex, &opp);
+            stopTimer(PARSE_NS, startTime);
+            turn = joinChain(state, &opp);
+        }
+        post(&state->semLockRead);
+
+        // If no instructions left
+        if (oppIndex >= state->binary->numOpps) {
+            state->reorderBuffer->close(oppIndex);
+            signalConsumerDone(state);
+            return 0;
+        }
+        count(LINES_READ);
+
+        if (state->keyChains != nullptr) {
+            executeKeyedOperation(state, &opp, turn, &outputLine);
+            state->reorderBuffer->put(oppIndex, &outputLine);
+            continue;
+        }
+
+        // Wait for right turn to execute
+        startTime = startTimer();
+        state->currOppExecuteIndex.waitFor(oppIndex);
+        stopTimer(TURN_WAIT_NS, startTime);
+
+        startTime = startTimer();
+        decodeOperation(state->binary, oppIndex, insertIndex, &opp);
+        stopTimer(PARSE_NS, startTime);
+        executeOperation(state, &opp, &outputLine);
+
+        state->reorderBuffer->put(oppIndex, &outputLine);
+    }
 }
 
-mapper_shared_state_t initState(stringstream* streamInput, ConcurrentMap* map,
-                                stringstream* outputBuffer) {
-    mapper_shared_state_t state;
+// Returns false if numConsumers is from a malformed thread count line
+bool initState(mapper_shared_state_t* state, int numConsumers, ConcurrentMap* map,
+               output_sink_t* outputSink, ReorderBuffer* reorderBuffer) {
+    state->inputBuffer = nullptr;
+    state->binary = nullptr;
+    state->keyChains = nullptr;
+    state->map = map;
+    state->outputSink = outputSink;
+    state->reorderBuffer = reorderBuffer;
+
+    state->remainingConsumers = numConsumers;
+    if (state->remainingConsumers < 1) {
+        writeOutput(outputSink, MALFORMED_THREAD_COUNT.data(), MALFORMED_THREAD_COUNT.length());
+        return false;
+    }
+    string threadsLine = "Using " + to_string(state->remainingConsumers) + " threads to consume\n";
+    writeOutput(outputSink, threadsLine.data(), threadsLine.length());
+
+    init(&state->semRemainingConsumers, 1);
+    init(&state->semAllConsumersDone, 0);
+    init(&state->semLockScheduleOpp, 1);
+    init(&state->semLockRead, 1);
+    state->currOppReadIndex = 0;
+    state->numBlankLines = 0;
+    return true;
+}
 
-    state.inputBuffer = streamInput;
-    state.map = map;
-    state.outputBuffer = outputBuffer;
+// Starts a consumer running consume for each thread in state and writes their results in order.
+// In keyed mode, operations are chained by key and parallelism is set if it isn't nullptr.
+void runConsumers(mapper_shared_state_t* state, void* (*consume)(void*), execution_mode_t mode,
+                  parallelism_t* parallelism) {
+    KeyChains keyChains;
+    if (mode == KEYED_MODE) state->keyChains = &keyChains;
+
+    vector<pthread_t> threads(state->remainingConsumers);
+    for (pthread_t& thread : threads) {
+        int status = pthread_create(&thread, nullptr, consume, state);
+        if (status != 0) {
+            cout << "Error starting thread\n";
+            return;
+        }
+    }
 
+    // Write results in order while the consumers run
+    state->reorderBuffer->drain(state->outputSink);
+
+    sem_wait(&state->semAllConsumersDone);
+    // Consumers still touch state after signaling, so wait for them to exit before it goes away
+    for (pthread_t& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    if (mode == KEYED_MODE && parallelism != nullptr) *parallelism = keyChains.getParallelism();
+    state->keyChains = nullptr;
+}
+
+// Runs the input stream and writes the output to outputSink as it finishes
+void executeStream(istream* streamInput, ConcurrentMap* map, output_sink_t* outputSink,
+                   execution_mode_t mode, parallelism_t* parallelism) {
     string threadsInfoLine;
     // Get the first line which contains the number of threads to use
     getline(*streamInput, threadsInfoLine);
     // Parse the number of consumers to use
-    state.remainingConsumers = stoi(threadsInfoLine.substr(2, threadsInfoLine.length() - 2));
-    *state.outputBuffer << "Using " << state.remainingConsumers << " threads to consume\n";
-
-    init(&state.semRemainingConsumers, 1);
-    init(&state.semAllConsumersDone, 0);
-    init(&state.semLockScheduleOpp, 1);
-    init(&state.semLockOut, 1);
-    init(&state.semLockRead, 1);
-    state.currOppReadIndex = 0;
-    state.currOppExecuteIndex = 0;
-    state.oppToOutputIndex = 0;
-
-    return state;
+    int numConsumers = parseThreadCount(threadsInfoLine.data(), threadsInfoLine.length());
+
+    ReorderBuffer reorderBuffer(REORDER_BUFFER_LINES);
+    mapper_shared_state_t state;
+    if (!initState(&state, numConsumers, map, outputSink, &reorderBuffer)) return;
+    state.inputBuffer = streamInput;
+    runConsumers(&state, consumeLineThread, mode, parallelism);
+}
+
+void executeBinary(binary_instructions_t* instructions, ConcurrentMap* map,
+                   output_sink_t* outputSink, execution_mode_t mode, parallelism_t* parallelism) {
+    if (mode == PARTITIONED_MODE) {
+        executeBinaryPartitioned(instructions, map, outputSink);
+        return;
+    }
+
+    ReorderBuffer reorderBuffer(REORDER_BUFFER_LINES);
+    mapper_shared_state_t state;
+    if (!initState(&state, instructions->numThreads, map, outputSink, &reorderBuffer)) return;
+    state.binary = instructions;
+    state.binaryInsertIndex = 0;
+    runConsumers(&state, consumeBinaryThread, mode, parallelism);
 }
 
 // Runs the input stream and returns output in stringstream buffer
 // Argument map is for testing
 stringstream executeStream(stringstream* streamInput, ConcurrentMap* map) {
-    stringstream outputBuffer;
-    mapper_shared_state_t state = initState(streamInput, map, &outputBuffer);
-
-    for (int i = state.remainingConsumers; i > 0; i--) {
-        pthread_t thread;
-        int status = pthread_create(&thread, nullptr, consumeLineThread, &state);
-        if (status != 0) {
-            cout << "Error starting thread\n";
-            return outputBuffer;
-        }
-    }
+    return executeStream(streamInput, map, SEQUENCED_MODE);
+}
 
-    sem_wait(&state.semAllConsumersDone);
+stringstream executeStream(stringstream* streamInput, ConcurrentMap* map, execution_mode_t mode) {
+    if (mode == PARTITIONED_MODE) return executeStreamPartitioned(streamInput, map);
 
-    delete state.map;
+    stringstream outputBuffer;
+    output_sink_t outputSink = {-1, &outputBuffer, false};
+    executeStream(streamInput, map, &outputSink, mode);
+    delete map;
     return outputBuffer;
 }
 
@@ -242,21 +358,120 @@ stringstream executeStream(stringstream* streamInput) {
     return executeStream(streamInput, new ConcurrentMap());
 }
 
-void executeFile(string pathInput, string pathOutput) {
+// Opens the output file so output can be written as it finishes instead of being collected in
+// memory. A path of - is stdout. Returns -1 if it can't be opened.
+int openOutput(string pathOutput, ostream* log) {
+    if (pathOutput == "-") return STDOUT_FILENO;
+
+    int fdOutput = open(pathOutput.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fdOutput == -1) *log << "Error opening file\n";
+    return fdOutput;
+}
+
+void closeOutput(int fdOutput) {
+    if (fdOutput != STDOUT_FILENO) close(fdOutput);
+}
+
+// Runs pathInput on map. Returns false if a file couldn't be opened or the output couldn't be
+// written.
+bool runFile(string pathInput, string pathOutput, execution_mode_t mode, ConcurrentMap* map) {
+    // Progress can't share stdout with the output
+    ostream* log = pathOutput == "-" ? &cerr : &cout;
+    if (pathInput == "-") pathInput = "/dev/stdin";
+
+    // Pipes and FIFOs can't be mapped or seeked, so they are run as they are read
+    struct stat inputInfo;
+    bool isStreamed = stat(pathInput.c_str(), &inputInfo) == 0 && !S_ISREG(inputInfo.st_mode);
+
+    if (mode == PARTITIONED_MODE && isStreamed) {
+        int fdInput = open(pathInput.c_str(), O_RDONLY);
+        if (fdInput == -1) {
+            *log << "Error opening file\n";
+            return false;
+        }
+
+        int fdOutput = openOutput(pathOutput, log);
+        if (fdOutput == -1) {
+            close(fdInput);
+            return false;
+        }
+        output_sink_t outputSink = {fdOutput, nullptr, false};
+
+        *log << "Executing stream\n";
+        executeFdPartitioned(fdInput, map, &outputSink);
+        close(fdInput);
+        closeOutput(fdOutput);
+        return !outputSink.failed;
+    }
+
+    if (!isStreamed) {
+        MappedFile fileInput(pathInput);
+        if (fileInput.isOpen() && isBinaryInstructions(fileInput.begin(), fileInput.size())) {
+            binary_instructions_t instructions;
+            if (!openBinaryInstructions(fileInput.begin(), fileInput.size(), &instructions)) {
+                *log << "Error reading binary instructions\n";
+                return false;
+            }
+
+            int fdOutput = openOutput(pathOutput, log);
+            if (fdOutput == -1) return false;
+            output_sink_t outputSink = {fdOutput, nullptr, false};
+
+            *log << "Executing binary file\n";
+            parallelism_t parallelism = {0, 0, 0};
+            executeBinary(&instructions, map, &outputSink, mode, &parallelism);
+            closeOutput(fdOutput);
+            if (mode == KEYED_MODE) writeParallelism(log, &parallelism);
+            return !outputSink.failed;
+        }
+    }
+
+    if (mode == PARTITIONED_MODE) {
+        // Workers parse the file straight from the mapping
+        MappedFile fileInput(pathInput);
+
+        if (!fileInput.isOpen()) {
+            *log << "Error opening file\n";
+            return false;
+        }
+
+        int fdOutput = openOutput(pathOutput, log);
+        if (fdOutput == -1) return false;
+        output_sink_t outputSink = {fdOutput, nullptr, false};
+
+        *log << "Executing file\n";
+        executeBufferPartitioned(fileInput.begin(), fileInput.size(), map, &outputSink);
+        closeOutput(fdOutput);
+        return !outputSink.failed;
+    }
+
     ifstream fileInput(pathInput, ifstream::in);
 
     if (!fileInput.is_open()) {
-        cout << "Error opening file\n";
-        return;
+        *log << "Error opening file\n";
+        return false;
     }
 
-    cout << "Loading file into memory\n";
-    stringstream outputStream;
-    outputStream << fileInput.rdbuf();
+    int fdOutput = openOutput(pathOutput, log);
+    if (fdOutput == -1) return false;
+    output_sink_t outputSink = {fdOutput, nullptr, false};
+
+    // Consumers read lines straight from the file as they need them
+    *log << "Executing file\n";
+    parallelism_t parallelism = {0, 0, 0};
+    executeStream(&fileInput, map, &outputSink, mode, &parallelism);
+    closeOutput(fdOutput);
+    if (mode == KEYED_MODE) writeParallelism(log, &parallelism);
+    return !outputSink.failed;
+}
 
-    cout << "Executing file\n";
-    stringstream outputBuffer = executeStream(&outputStream);
+bool executeFile(string pathInput, string pathOutput, execution_mode_t mode, ConcurrentMap* map,
+                 string pathSnapshot) {
+    if (map == nullptr) map = new ConcurrentMap();
 
-    cout << "Writing output to disk\n";
-    write(&outputBuffer, pathOutput);
+    // A run whose output was lost isn't saved, so it can be rerun from the old snapshot
+    bool ran = runFile(pathInput, pathOutput, mode, map);
+    if (ran && !pathSnapshot.empty()) ran = writeSnapshot(map, pathSnapshot);
+    delete map;
+    return ran;
 }
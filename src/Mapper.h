@@ -1,16 +1,53 @@
+#pragma once
+
+#include <istream>
 #include <string>
 
+#include "BinaryInstructions.h"
 #include "ConcurrentMap.h"
+#include "KeyChains.h"
+#include "OutputBuffer.h"
 #include "Semaphore.h"
 
 struct mapper_state_t;
 
-void* consumeLineThread(void* uncastArgs);
+enum execution_mode_t {
+    // Consumers take turns executing operations in file order
+    SEQUENCED_MODE,
+    // Operations are routed to the worker that owns their key
+    PARTITIONED_MODE,
+    // Consumers run each operation once the operation before it on the same key has finished
+    KEYED_MODE,
+};
 
-void write(stringstream* stream, string pathOutput);
+void* consumeLineThread(void* uncastArgs);
 
 stringstream executeStream(stringstream* streamInput);
 
 stringstream executeStream(stringstream* streamInput, ConcurrentMap* map);
 
-void executeFile(string pathInput, string pathOutput);
+stringstream executeStream(stringstream* streamInput, ConcurrentMap* map, execution_mode_t mode);
+
+// Runs the input stream on map and writes the output to outputSink in order as it finishes.
+// Lines are read as consumers need them, so the stream can still be arriving. The caller keeps
+// map. mode is sequenced or keyed, and in keyed mode parallelism is set if it isn't nullptr.
+void executeStream(istream* streamInput, ConcurrentMap* map, output_sink_t* outputSink,
+                   execution_mode_t mode = SEQUENCED_MODE, parallelism_t* parallelism = nullptr);
+
+// Runs binary instructions on map in mode and writes the output to outputSink in order as it
+// finishes. The caller keeps map and the memory instructions points into. In keyed mode,
+// parallelism is set if it isn't nullptr.
+void executeBinary(binary_instructions_t* instructions, ConcurrentMap* map,
+                   output_sink_t* outputSink, execution_mode_t mode = SEQUENCED_MODE,
+                   parallelism_t* parallelism = nullptr);
+
+// Runs the instructions in pathInput on map, or a default map if it is nullptr,
+// and writes the output to pathOutput while it runs. A path of - is stdin or stdout.
+// Input that isn't a regular file, like a pipe, is run as it arrives.
+// A regular file in the binary instruction format is decoded instead of parsed.
+// In keyed mode, how much parallelism the input exposes is printed once it has run.
+// If pathSnapshot is set, the map is written to a snapshot there once the run finishes.
+// The map is deleted when it returns. Returns false if a file couldn't be opened or written, in
+// which case no snapshot is saved.
+bool executeFile(string pathInput, string pathOutput, execution_mode_t mode = SEQUENCED_MODE,
+                 ConcurrentMap* map = nullptr, string pathSnapshot = "");
@@ -0,0 +1,447 @@
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ConcurrentMap.h"
+#include "Mapper.h"
+#include "MapperEngine.h"
+#include "Topology.h"
+#include "Workload.h"
+
+using namespace std;
+
+enum bench_target_t {
+    // Threads run operations straight on the map
+    MAP_TARGET,
+    // The whole mapper in sequenced mode
+    SEQUENCED_TARGET,
+    // The whole mapper in partitioned mode
+    PARTITIONED_TARGET,
+    // A long-lived Mapper running the operations as many small inputs
+    POOL_TARGET,
+    // The whole mapper in keyed mode
+    KEYED_TARGET,
+};
+
+const char* TARGET_NAMES[] = {"map", "sequenced", "partitioned", "pool", "keyed"};
+
+// Operations in each input given to the pool target
+const int POOL_INPUT_OPPS = 100;
+
+const char* DISTRIBUTION_NAMES[] = {"uniform", "zipf", "single-bucket"};
+
+struct bench_config_t {
+    workload_t workload;
+
+    int numOpps;
+
+    vector<int> threadCounts;
+
+    vector<int> bucketCounts;
+
+    vector<bench_target_t> targets;
+
+    map_backend_t backend;
+
+    lock_strategy_t lockStrategy;
+
+    hash_policy_t hashPolicy;
+
+    int numStripes;
+
+    // Map shards, one per NUMA node with --numa
+    int numShards;
+
+    bool json;
+
+    // Whether the shape of the map is written to stderr after each map measurement
+    bool mapStats;
+};
+
+struct bench_result_t {
+    bench_target_t target;
+
+    int numBuckets;
+
+    int numThreads;
+
+    double seconds;
+
+    double oppsPerSecond;
+
+    // Per operation latency, or -1 when only the whole run is timed
+    long p50Nanoseconds;
+
+    long p99Nanoseconds;
+
+    // Throughput per thread relative to the fewest threads in the sweep
+    double efficiency;
+};
+
+struct map_thread_args_t {
+    ConcurrentMap* map;
+
+    vector<operation_t> opps;
+
+    pthread_barrier_t* start;
+
+    vector<uint32_t> latencies;
+};
+
+// Runs the thread's operations and records how long each took
+void* runMapOperationsThread(void* uncastArgs) {
+    map_thread_args_t* args = (map_thread_args_t*)uncastArgs;
+    args->latencies.reserve(args->opps.size());
+    pthread_barrier_wait(args->start);
+
+    string found;
+    for (operation_t& opp : args->opps) {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        if (opp.type == INSERT) {
+            args->map->insertAndPost(opp.key, opp.value, opp.valueLength, nullptr);
+        } else if (opp.type == LOOKUP) {
+            args->map->lookupAndPost(opp.key, &found, nullptr);
+        } else {
+            args->map->removeAndPost(opp.key, nullptr);
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+        args->latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+    }
+    return 0;
+}
+
+// Returns the latency that fraction of operations finished within
+long percentile(vector<uint32_t>* latencies, double fraction) {
+    if (latencies->empty()) return 0;
+
+    size_t rank = min(latencies->size() - 1, (size_t)(fraction * latencies->size()));
+    nth_element(latencies->begin(), latencies->begin() + rank, latencies->end());
+    return (*latencies)[rank];
+}
+
+bench_result_t runMap(bench_config_t* config, vector<operation_t>* opps, int numBuckets,
+                      int numThreads) {
+    ConcurrentMap map(numBuckets, 0, config->backend, config->lockStrategy, config->numStripes,
+                      config->hashPolicy, config->numShards);
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, nullptr, numThreads + 1);
+
+    // Deal the operations out in turn so each thread sees the same mix
+    vector<map_thread_args_t> args(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        args[i].map = &map;
+        args[i].start = &start;
+    }
+    for (size_t i = 0; i < opps->size(); i++) {
+        args[i % numThreads].opps.push_back((*opps)[i]);
+    }
+
+    vector<pthread_t> threads(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_create(&threads[i], nullptr, runMapOperationsThread, &args[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    for (pthread_t& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    pthread_barrier_destroy(&start);
+
+    if (config->mapStats) {
+        map_stats_t stats = map.stats();
+        cerr << "map with " << numBuckets << " buckets after " << numThreads << " threads:\n";
+        writeMapStats(&cerr, &stats);
+    }
+
+    vector<uint32_t> latencies;
+    latencies.reserve(opps->size());
+    for (map_thread_args_t& threadArgs : args) {
+        latencies.insert(latencies.end(), threadArgs.latencies.begin(), threadArgs.latencies.end());
+    }
+
+    bench_result_t result;
+    result.seconds = chrono::duration<double>(end - begin).count();
+    result.p50Nanoseconds = percentile(&latencies, 0.50);
+    result.p99Nanoseconds = percentile(&latencies, 0.99);
+    return result;
+}
+
+bench_result_t runMapper(bench_config_t* config, vector<operation_t>* opps, int numBuckets,
+                         int numThreads, bench_target_t target) {
+    string instructions = formatInstructions(opps, numThreads);
+    ConcurrentMap* map = new ConcurrentMap(numBuckets, 0, config->backend, config->lockStrategy,
+                                           config->numStripes, config->hashPolicy,
+                                           config->numShards);
+
+    // Split the operations into small inputs up front, without thread count lines
+    vector<string> poolInputs;
+    if (target == POOL_TARGET) {
+        for (size_t start = 0; start < opps->size(); start += POOL_INPUT_OPPS) {
+            size_t stop = min(start + POOL_INPUT_OPPS, opps->size());
+            vector<operation_t> inputOpps(opps->begin() + start, opps->begin() + stop);
+            string input = formatInstructions(&inputOpps, numThreads);
+            poolInputs.push_back(input.substr(input.find('\n') + 1));
+        }
+    }
+
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    if (target == POOL_TARGET) {
+        Mapper mapper(numThreads, map);
+        stringstream output;
+        output_sink_t outputSink = {-1, &output, false};
+        for (string& input : poolInputs) {
+            mapper.execute(input.data(), input.size(), &outputSink);
+        }
+    } else if (target == PARTITIONED_TARGET) {
+        executeBufferPartitioned(instructions.data(), instructions.size(), map);
+    } else {
+        stringstream input(instructions);
+        executeStream(&input, map, target == KEYED_TARGET ? KEYED_MODE : SEQUENCED_MODE);
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+    bench_result_t result;
+    result.seconds = chrono::duration<double>(end - begin).count();
+    result.p50Nanoseconds = -1;
+    result.p99Nanoseconds = -1;
+    return result;
+}
+
+void printCsvHeader() {
+    cout << "workload,target,buckets,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,efficiency\n";
+}
+
+void printResult(bench_config_t* config, bench_result_t* result, bool first) {
+    const char* workloadName = DISTRIBUTION_NAMES[config->workload.distribution];
+    const char* targetName = TARGET_NAMES[result->target];
+
+    if (!config->json) {
+        cout << workloadName << "," << targetName << "," << result->numBuckets << ","
+             << result->numThreads << "," << config->numOpps << "," << result->seconds << ","
+             << (long)result->oppsPerSecond << ",";
+        if (result->p50Nanoseconds >= 0) {
+            cout << result->p50Nanoseconds << "," << result->p99Nanoseconds;
+        } else {
+            cout << ",";
+        }
+        cout << "," << result->efficiency << "\n";
+        return;
+    }
+
+    cout << (first ? "[\n" : ",\n") << "  {\"workload\": \"" << workloadName << "\", \"target\": \""
+         << targetName << "\", \"buckets\": " << result->numBuckets
+         << ", \"threads\": " << result->numThreads << ", \"ops\": " << config->numOpps
+         << ", \"seconds\": " << result->seconds
+         << ", \"ops_per_sec\": " << (long)result->oppsPerSecond;
+    if (result->p50Nanoseconds >= 0) {
+        cout << ", \"p50_ns\": " << result->p50Nanoseconds
+             << ", \"p99_ns\": " << result->p99Nanoseconds;
+    }
+    cout << ", \"efficiency\": " << result->efficiency << "}";
+}
+
+// Parses a comma separated list of positive numbers into values.
+// Returns false if any of them is not a positive number.
+bool parseCounts(string list, vector<int>* values) {
+    values->clear();
+    stringstream items(list);
+    string item;
+    while (getline(items, item, ',')) {
+        char* end;
+        long value = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value < 1 || value > 1 << 30) return false;
+        values->push_back(value);
+    }
+    return !values->empty();
+}
+
+// Parses an option of the form name=value, returning false if arg is a different option
+bool isOption(string arg, string name, string* value) {
+    string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.length(), prefix) != 0) return false;
+    *value = arg.substr(prefix.length());
+    return true;
+}
+
+// Parses the command line into config. Returns false if an argument is not understood.
+bool parseArgs(int argc, char** argv, bench_config_t* config) {
+    config->workload = defaultWorkload();
+    config->numOpps = 1 << 20;
+    config->threadCounts = {1, 2, 4, 8};
+    config->bucketCounts = {1000};
+    config->targets = {MAP_TARGET};
+    config->backend = CHAINED_BACKEND;
+    config->lockStrategy = SEMAPHORE_LOCK;
+    config->hashPolicy = MIX_HASH;
+    config->numStripes = 0;
+    config->numShards = 1;
+    config->json = false;
+    config->mapStats = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        string value;
+        vector<int> counts;
+
+        if (isOption(arg, "workload", &value)) {
+            if (value == "uniform") {
+                config->workload.distribution = UNIFORM_KEYS;
+            } else if (value == "zipf") {
+                config->workload.distribution = ZIPF_KEYS;
+            } else if (value == "single-bucket") {
+                config->workload.distribution = SINGLE_BUCKET_KEYS;
+            } else {
+                return false;
+            }
+        } else if (isOption(arg, "keys", &value)) {
+            if (!parseCounts(value, &counts) || counts.size() != 1) return false;
+            config->workload.numKeys = counts[0];
+        } else if (isOption(arg, "skew", &value)) {
+            config->workload.zipfSkew = atof(value.c_str());
+            if (config->workload.zipfSkew <= 0) return false;
+        } else if (isOption(arg, "mix", &value)) {
+            // Insert, lookup, and delete percentages that add up to 100
+            int insert, lookup, remove;
+            char extra;
+            if (sscanf(value.c_str(), "%d,%d,%d%c", &insert, &lookup, &remove, &extra) != 3 ||
+                insert < 0 || lookup < 0 || remove < 0 || insert + lookup + remove != 100) {
+                return false;
+            }
+            config->workload.insertPercent = insert;
+            config->workload.lookupPercent = lookup;
+        } else if (isOption(arg, "ops", &value)) {
+            if (!parseCounts(value, &counts) || counts.size() != 1) return false;
+            config->numOpps = counts[0];
+        } else if (isOption(arg, "seed", &value)) {
+            config->workload.seed = strtoul(value.c_str(), nullptr, 10);
+        } else if (isOption(arg, "threads", &value)) {
+            if (!parseCounts(value, &config->threadCounts)) return false;
+        } else if (isOption(arg, "buckets", &value)) {
+            if (!parseCounts(value, &config->bucketCounts)) return false;
+        } else if (isOption(arg, "target", &value)) {
+            config->targets.clear();
+            stringstream items(value);
+            string item;
+            while (getline(items, item, ',')) {
+                if (item == "map") {
+                    config->targets.push_back(MAP_TARGET);
+                } else if (item == "sequenced") {
+                    config->targets.push_back(SEQUENCED_TARGET);
+                } else if (item == "partitioned") {
+                    config->targets.push_back(PARTITIONED_TARGET);
+                } else if (item == "pool") {
+                    config->targets.push_back(POOL_TARGET);
+                } else if (item == "keyed") {
+                    config->targets.push_back(KEYED_TARGET);
+                } else {
+                    return false;
+                }
+            }
+            if (config->targets.empty()) return false;
+        } else if (arg == "--backend=chained") {
+            config->backend = CHAINED_BACKEND;
+        } else if (arg == "--backend=flat") {
+            config->backend = FLAT_BACKEND;
+        } else if (arg == "--lock=semaphore") {
+            config->lockStrategy = SEMAPHORE_LOCK;
+        } else if (arg == "--lock=spin") {
+            config->lockStrategy = SPIN_LOCK;
+        } else if (arg == "--lock=rw") {
+            config->lockStrategy = RW_LOCK;
+        } else if (arg == "--lock=optimistic") {
+            config->lockStrategy = OPTIMISTIC_LOCK;
+        } else if (arg == "--hash=mix") {
+            config->hashPolicy = MIX_HASH;
+        } else if (arg == "--hash=modulo") {
+            config->hashPolicy = MODULO_HASH;
+        } else if (isOption(arg, "stripes", &value)) {
+            if (!parseCounts(value, &counts) || counts.size() != 1) return false;
+            config->numStripes = counts[0];
+        } else if (arg == "--numa") {
+            config->numShards = readNumaNodes().size();
+        } else if (isOption(arg, "numa", &value)) {
+            if (!parseCounts(value, &counts) || counts.size() != 1) return false;
+            config->numShards = counts[0];
+        } else if (arg == "--format=csv") {
+            config->json = false;
+        } else if (arg == "--format=json") {
+            config->json = true;
+        } else if (arg == "--map-stats") {
+            config->mapStats = true;
+        } else {
+            return false;
+        }
+    }
+
+    // Only mixed keys put a partition's keys in one shard, so shards need the mixing hash
+    if (config->numShards > 1 && config->hashPolicy != MIX_HASH) return false;
+
+    // Single bucket keys collide under the map's hash, for every bucket count in the sweep
+    config->workload.hashPolicy = config->hashPolicy;
+    for (int numBuckets : config->bucketCounts) {
+        config->workload.numBuckets = numBuckets;
+        if (!workloadFits(&config->workload)) return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bench_config_t config;
+    if (!parseArgs(argc, argv, &config)) {
+        cout << "Usage: mapper-bench [--workload=uniform|zipf|single-bucket] [--keys=N]\n"
+                "                    [--skew=S] [--mix=INSERT,LOOKUP,DELETE] [--ops=N]\n"
+                "                    [--seed=N] [--threads=N,...] [--buckets=N,...]\n"
+                "                    [--target=map|sequenced|partitioned|pool|keyed,...]\n"
+                "                    [--backend=chained|flat]\n"
+                "                    [--lock=semaphore|spin|rw|optimistic] [--stripes=N]\n"
+                "                    [--hash=mix|modulo] [--numa[=N]]\n"
+                "                    [--format=csv|json] [--map-stats]\n";
+        return 1;
+    }
+
+    if (!config.json) printCsvHeader();
+    bool first = true;
+
+    for (bench_target_t target : config.targets) {
+        for (int numBuckets : config.bucketCounts) {
+            // Single bucket keys depend on the bucket count, so each count gets its own operations
+            config.workload.numBuckets = numBuckets;
+            vector<operation_t> opps = generateOperations(config.workload, config.numOpps);
+
+            double baselinePerThread = 0;
+            for (int numThreads : config.threadCounts) {
+                bench_result_t result;
+                if (target == MAP_TARGET) {
+                    result = runMap(&config, &opps, numBuckets, numThreads);
+                } else {
+                    result = runMapper(&config, &opps, numBuckets, numThreads, target);
+                }
+                result.target = target;
+                result.numBuckets = numBuckets;
+                result.numThreads = numThreads;
+                result.oppsPerSecond = config.numOpps / result.seconds;
+
+                // The first thread count in the sweep is the baseline
+                if (baselinePerThread == 0) baselinePerThread = result.oppsPerSecond / numThreads;
+                result.efficiency = result.oppsPerSecond / numThreads / baselinePerThread;
+
+                printResult(&config, &result, first);
+                first = false;
+            }
+        }
+    }
+
+    if (config.json) cout << (first ? "[]\n" : "\n]\n");
+}
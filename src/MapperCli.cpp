@@ -1,12 +1,112 @@
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include "Counters.h"
 #include "Mapper.h"
+#include "Snapshot.h"
+#include "Topology.h"
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        cout << "Missing filename\nUsage: mapper [INPUT FILE...] [OUTPUT FILE...]\n";
+    execution_mode_t mode = SEQUENCED_MODE;
+    map_backend_t backend = CHAINED_BACKEND;
+    lock_strategy_t lockStrategy = SEMAPHORE_LOCK;
+    hash_policy_t hashPolicy = MIX_HASH;
+    // One lock per bucket
+    int numStripes = 0;
+    int numShards = 1;
+    bool stats = false;
+    // Stats go to stderr as text unless a path for JSON is given
+    string statsPath;
+    string loadSnapshotPath;
+    string saveSnapshotPath;
+    vector<string> paths;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--mode=sequenced") {
+            mode = SEQUENCED_MODE;
+        } else if (arg == "--mode=partitioned") {
+            mode = PARTITIONED_MODE;
+        } else if (arg == "--mode=keyed") {
+            mode = KEYED_MODE;
+        } else if (arg == "--backend=chained") {
+            backend = CHAINED_BACKEND;
+        } else if (arg == "--backend=flat") {
+            backend = FLAT_BACKEND;
+        } else if (arg == "--lock=semaphore") {
+            lockStrategy = SEMAPHORE_LOCK;
+        } else if (arg == "--lock=spin") {
+            lockStrategy = SPIN_LOCK;
+        } else if (arg == "--lock=rw") {
+            lockStrategy = RW_LOCK;
+        } else if (arg == "--lock=optimistic") {
+            lockStrategy = OPTIMISTIC_LOCK;
+        } else if (arg == "--hash=mix") {
+            hashPolicy = MIX_HASH;
+        } else if (arg == "--hash=modulo") {
+            hashPolicy = MODULO_HASH;
+        } else if (arg.compare(0, 10, "--stripes=") == 0) {
+            numStripes = atoi(arg.c_str() + 10);
+        } else if (arg == "--numa") {
+            numShards = readNumaNodes().size();
+        } else if (arg.compare(0, 7, "--numa=") == 0) {
+            numShards = atoi(arg.c_str() + 7);
+        } else if (arg.compare(0, 16, "--load-snapshot=") == 0) {
+            loadSnapshotPath = arg.substr(16);
+        } else if (arg.compare(0, 16, "--save-snapshot=") == 0) {
+            saveSnapshotPath = arg.substr(16);
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg.compare(0, 8, "--stats=") == 0) {
+            stats = true;
+            statsPath = arg.substr(8);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (paths.size() != 2 || numStripes < 0 || numShards < 1) {
+        cout << "Missing filename\n"
+                "Usage: mapper [--mode=sequenced|partitioned|keyed] [--backend=chained|flat] "
+                "[--lock=semaphore|spin|rw|optimistic] [--hash=mix|modulo] [--stripes=N] "
+                "[--numa[=N]] [--stats[=PATH]] [--load-snapshot=PATH] [--save-snapshot=PATH] "
+                "[INPUT FILE|-] [OUTPUT FILE|-]\n";
         return 0;
     }
 
-    executeFile(argv[1], argv[2]);
+    // Only mixed keys put a partition's keys in one shard, so shards need the mixing hash
+    if (numShards > 1 && hashPolicy != MIX_HASH) {
+        cerr << "--numa needs --hash=mix\n";
+        return 1;
+    }
+
+    if (stats) {
+        countersEnabled = true;
+        setCounterRole("main");
+    }
+
+    ConcurrentMap* map =
+        new ConcurrentMap(1000, 0, backend, lockStrategy, numStripes, hashPolicy, numShards);
+    if (!loadSnapshotPath.empty() && !readSnapshot(loadSnapshotPath, map)) {
+        delete map;
+        return 1;
+    }
+
+    bool ran = executeFile(paths[0], paths[1], mode, map, saveSnapshotPath);
+
+    if (stats && statsPath.empty()) {
+        writeCounters(&cerr, false);
+    } else if (stats) {
+        ofstream statsFile(statsPath);
+        if (!statsFile.is_open()) {
+            cerr << "Error opening stats file\n";
+            return 0;
+        }
+        writeCounters(&statsFile, true);
+    }
+    return ran ? 0 : 1;
 }
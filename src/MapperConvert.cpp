@@ -0,0 +1,51 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "BinaryInstructions.h"
+#include "MappedFile.h"
+
+// Converts a text instruction file to binary, or a binary one back to text
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        cout << "Usage: mapper-convert [INPUT FILE] [OUTPUT FILE]\n"
+                "Text input is converted to binary and binary input to text\n";
+        return 1;
+    }
+    string pathInput = argv[1];
+    string pathOutput = argv[2];
+
+    MappedFile fileInput(pathInput);
+    if (!fileInput.isOpen()) {
+        cerr << "Error opening file\n";
+        return 1;
+    }
+
+    ofstream fileOutput(pathOutput, ofstream::out | ofstream::binary | ofstream::trunc);
+    if (!fileOutput.is_open()) {
+        cerr << "Error opening file\n";
+        return 1;
+    }
+
+    if (isBinaryInstructions(fileInput.begin(), fileInput.size())) {
+        binary_instructions_t instructions;
+        if (!openBinaryInstructions(fileInput.begin(), fileInput.size(), &instructions)) {
+            cerr << "Error reading binary instructions\n";
+            return 1;
+        }
+        convertBinaryToText(&instructions, &fileOutput);
+    } else {
+        ifstream textInput(pathInput, ifstream::in);
+        if (!convertTextToBinary(&textInput, &fileOutput)) {
+            cerr << "Error converting: values are larger than 4 GB\n";
+            return 1;
+        }
+    }
+
+    fileOutput.close();
+    if (fileOutput.fail()) {
+        cerr << "Error writing file\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,954 @@
+#include "MapperEngine.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BinaryInstructions.h"
+#include "Counters.h"
+#include "Operation.h"
+#include "OutputBuffer.h"
+#include "Semaphore.h"
+#include "Topology.h"
+
+// Operations whose keys hash to the same partition run in file order, on one worker at a time.
+// Having several partitions per worker leaves idle workers something to steal when keys are skewed.
+const int PARTITIONS_PER_WORKER = 8;
+
+// Number of batches a Mapper dispatches before waiting to write the oldest one, and the number of
+// chunks workers parse ahead of the writer. A parsed batch is several times the size of its input,
+// so this bounds the memory used by an input of any length.
+const size_t MAX_BATCHES_IN_FLIGHT = 64;
+
+// Shortest run of map operations in a partition's share of a batch that is run in bulk. Shorter
+// runs touch too few keys per segment to save locking.
+const size_t MIN_BULK_OPPS = 32;
+
+// Where an operation's output line is in the output of its partition
+struct batch_result_t {
+    int partition;
+
+    size_t start;
+
+    size_t length;
+};
+
+// The operations parsed from one chunk of the input
+struct engine_batch_t {
+    // Position of the chunk in the input
+    long unsigned int index;
+
+    vector<operation_t> opps;
+
+    // Indexes into opps, one list for each partition
+    vector<vector<int>> partitionOpps;
+
+    // Output line of each operation
+    vector<batch_result_t> results;
+
+    // Output of each partition's operations in the batch, in the order they ran. The batch is
+    // written straight from these.
+    vector<OutputBuffer> partitionOutput;
+
+    // Number of lines in the chunk, including blank lines
+    int numLines;
+
+    // Indexes into opps of malformed lines, which hold their line number within the chunk until
+    // the batch is dispatched
+    vector<int> invalidOpps;
+
+    // Counts partitions that have not finished their operations in this batch
+    atomic<int> remainingPartitions;
+
+    // The chunk's bytes when the input is streamed rather than mapped, since operations point
+    // into them
+    string input;
+
+};
+
+// Where batch i waits to be written, in slot i % MAX_BATCHES_IN_FLIGHT
+struct batch_slot_t {
+    engine_batch_t* batch;
+
+    // Posted when the workers have finished the batch
+    sem_t semDone;
+};
+
+struct engine_state_t;
+
+struct engine_partition_t {
+    // Batches with operations in this partition that haven't run, in file order
+    deque<engine_batch_t*> pending;
+
+    // Whether the partition is waiting in a worker's ready deque or being run. Only one worker
+    // runs a partition at a time, which keeps the operations on each key in order.
+    bool scheduled;
+
+    sem_t semLock;
+};
+
+struct engine_worker_t {
+    int id;
+
+    // CPU the worker is pinned to, or -1
+    int cpu;
+
+    engine_state_t* state;
+
+    // Partitions with pending batches. The worker takes from the front and idle workers steal
+    // from the back.
+    deque<int> ready;
+
+    sem_t semLockReady;
+
+    // Inserts run in bulk, reused between runs
+    vector<bulk_op_t> bulkOpps;
+};
+
+// Shared state for workers
+struct engine_state_t {
+    ConcurrentMap* map;
+
+    const char* input;
+
+    // Offset of the first instruction after the thread count line
+    size_t bodyStart;
+
+    size_t length;
+
+    size_t chunkBytes;
+
+    // Binary input, where chunks are chunkOpps instructions instead of bytes, or nullptr
+    binary_instructions_t* binary;
+
+    uint64_t chunkOpps;
+
+    long unsigned int numChunks;
+
+    // Next chunk to be claimed for parsing
+    atomic<long unsigned int> nextChunk;
+
+    // Batches whose output has been written. Chunks are only claimed while fewer than
+    // MAX_BATCHES_IN_FLIGHT batches are parsed but not written.
+    atomic<long unsigned int> batchesWritten;
+
+    // A slot is reused once its batch has been written
+    vector<batch_slot_t> slots;
+
+    // Written batches, reused so their buffers stop allocating once they fit. The most recently
+    // freed is reused first, so only as many batches as are in flight at once keep memory.
+    vector<engine_batch_t*> freeBatches;
+
+    sem_t semLockFreeBatches;
+
+    // Chunks can finish parsing out of order, so each batch waits here until the batches before it
+    // have been dispatched. Batch i is in slot i % MAX_BATCHES_IN_FLIGHT.
+    vector<engine_batch_t*> parsedBatches;
+
+    long unsigned int nextBatchToDispatch;
+
+    // Line number of the first line of the input
+    long unsigned int firstLine;
+
+    // Lines in the batches dispatched so far
+    long unsigned int linesDispatched;
+
+    sem_t semLockDispatch;
+
+    vector<engine_worker_t> workers;
+
+    vector<engine_partition_t> partitions;
+
+    // Counts partitions made ready, so idle workers sleep until there may be work
+    sem_t semWork;
+
+    // Set once no more batches will be dispatched, so workers exit when they run out of work
+    atomic<bool> finished;
+};
+
+// Keys are mixed so keys that share a map bucket, like multiples of the bucket count, still spread
+// across partitions. ConcurrentMap picks segments from the top bits of the same hash, so each
+// partition covers a contiguous range of segments and its bulk operations share segment locks.
+int partitionOf(int key, int numPartitions) {
+    return (uint64_t)mixHash(key) * numPartitions >> 32;
+}
+
+void initWorkers(engine_state_t* state, int numWorkers) {
+    state->finished = false;
+    init(&state->semWork, 0);
+
+    // Workers of a sharded map are spread over the shards' nodes in blocks, so the partitions that
+    // start on a worker hold keys of the shard on its node
+    int numShards = state->map->shards();
+    vector<numa_node_t> nodes;
+    if (numShards > 1) nodes = readNumaNodes();
+    vector<size_t> nextCpu(nodes.size(), 0);
+
+    state->workers.resize(numWorkers);
+    for (int i = 0; i < numWorkers; i++) {
+        state->workers[i].id = i;
+        state->workers[i].cpu = -1;
+        state->workers[i].state = state;
+        init(&state->workers[i].semLockReady, 1);
+
+        if (!nodes.empty()) {
+            int node = (long)i * numShards / numWorkers % nodes.size();
+            vector<int>* cpus = &nodes[node].cpus;
+            state->workers[i].cpu = (*cpus)[nextCpu[node]++ % cpus->size()];
+        }
+    }
+
+    state->partitions.resize(numWorkers * PARTITIONS_PER_WORKER);
+    for (engine_partition_t& partition : state->partitions) {
+        partition.scheduled = false;
+        init(&partition.semLock, 1);
+    }
+}
+
+void destroyWorkers(engine_state_t* state) {
+    for (engine_worker_t& worker : state->workers) {
+        sem_destroy(&worker.semLockReady);
+    }
+    for (engine_partition_t& partition : state->partitions) {
+        sem_destroy(&partition.semLock);
+    }
+    sem_destroy(&state->semWork);
+}
+
+batch_slot_t* slotOf(engine_state_t* state, long unsigned int index) {
+    return &state->slots[index % state->slots.size()];
+}
+
+void initBatches(engine_state_t* state) {
+    state->slots.resize(MAX_BATCHES_IN_FLIGHT);
+    for (batch_slot_t& slot : state->slots) {
+        slot.batch = nullptr;
+        init(&slot.semDone, 0);
+    }
+    init(&state->semLockFreeBatches, 1);
+}
+
+void destroyBatches(engine_state_t* state) {
+    for (batch_slot_t& slot : state->slots) {
+        sem_destroy(&slot.semDone);
+    }
+    for (engine_batch_t* batch : state->freeBatches) {
+        delete batch;
+    }
+    state->freeBatches.clear();
+    sem_destroy(&state->semLockFreeBatches);
+}
+
+// Wakes every worker so they exit once they run out of work
+void finishWorkers(engine_state_t* state) {
+    state->finished = true;
+    for (size_t i = 0; i < state->workers.size(); i++) {
+        post(&state->semWork);
+    }
+}
+
+// Adds a partition to the back of a worker's ready deque
+void makeReady(engine_worker_t* worker, int partition) {
+    wait(&worker->semLockReady);
+    worker->ready.push_back(partition);
+    post(&worker->semLockReady);
+    post(&worker->state->semWork);
+}
+
+// Queues the partition's operations in batch behind its earlier batches
+void schedule(engine_state_t* state, int partitionIndex, engine_batch_t* batch) {
+    engine_partition_t* partition = &state->partitions[partitionIndex];
+
+    wait(&partition->semLock);
+    partition->pending.push_back(batch);
+    bool wasScheduled = partition->scheduled;
+    partition->scheduled = true;
+    post(&partition->semLock);
+
+    // Partitions start out ready on the same worker each time. With a sharded map that is the
+    // worker whose block of keys holds the partition's keys.
+    if (!wasScheduled) {
+        int home = state->map->shards() > 1 ? partitionIndex / PARTITIONS_PER_WORKER
+                                            : partitionIndex % state->workers.size();
+        makeReady(&state->workers[home], partitionIndex);
+    }
+}
+// Returns the offset of the first line that starts at or after offset
+size_t lineStartAtOrAfter(engine_state_t* state, size_t offset) {
+    if (offset <= state->bodyStart) return state->bodyStart;
+    if (offset >= state->length) return state->length;
+
+    // offset is a line start if the byte before it ends a line
+    const char* lineEnd = (const char*)memchr(state->input + offset - 1, '\n',
+                                              state->length - offset + 1);
+    if (lineEnd == nullptr) return state->length;
+    return lineEnd - state->input + 1;
+}
+
+// Hands the batch to every partition that has one of its operations
+void dispatch(engine_state_t* state, engine_batch_t* batch) {
+    int numPartitions = state->partitions.size();
+
+    // Every line before the batch is known now, so malformed lines get their file line number
+    for (int i : batch->invalidOpps) {
+        batch->opps[i].key += state->firstLine + state->linesDispatched;
+    }
+    state->linesDispatched += batch->numLines;
+
+    int numOwners = 0;
+    for (int i = 0; i < numPartitions; i++) {
+        if (!batch->partitionOpps[i].empty()) numOwners++;
+    }
+
+    // A chunk without instructions still holds a place in the output,
+    // so the first partition outputs it
+    bool isEmpty = numOwners == 0;
+    if (isEmpty) numOwners = 1;
+    batch->remainingPartitions = numOwners;
+
+    // Workers may finish and free the batch while it is being handed out,
+    // so only the saved owner count is used from here on
+    for (int i = 0; i < numPartitions && numOwners > 0; i++) {
+        if (isEmpty || !batch->partitionOpps[i].empty()) {
+            numOwners--;
+            schedule(state, i, batch);
+        }
+    }
+}
+
+// Dispatches the batch once every batch before it has been dispatched
+void publish(engine_state_t* state, engine_batch_t* batch) {
+    wait(&state->semLockDispatch);
+
+    vector<engine_batch_t*>* parsed = &state->parsedBatches;
+    (*parsed)[batch->index % parsed->size()] = batch;
+    while (state->nextBatchToDispatch < state->numChunks &&
+           (*parsed)[state->nextBatchToDispatch % parsed->size()] != nullptr) {
+        int slot = state->nextBatchToDispatch % parsed->size();
+        dispatch(state, (*parsed)[slot]);
+        (*parsed)[slot] = nullptr;
+        state->nextBatchToDispatch++;
+
+        if (state->nextBatchToDispatch == state->numChunks) finishWorkers(state);
+    }
+
+    post(&state->semLockDispatch);
+}
+
+// Returns an empty batch for the chunk at index and puts it in the chunk's slot. A reused batch
+// keeps the capacity of its buffers.
+engine_batch_t* newBatch(engine_state_t* state, long unsigned int index) {
+    engine_batch_t* batch = nullptr;
+    wait(&state->semLockFreeBatches);
+    if (!state->freeBatches.empty()) {
+        batch = state->freeBatches.back();
+        state->freeBatches.pop_back();
+    }
+    post(&state->semLockFreeBatches);
+
+    if (batch == nullptr) {
+        batch = new engine_batch_t;
+        batch->partitionOpps.resize(state->partitions.size());
+        batch->partitionOutput.resize(state->partitions.size());
+    }
+    slotOf(state, index)->batch = batch;
+    batch->index = index;
+    batch->opps.clear();
+    for (vector<int>& partitionOpps : batch->partitionOpps) partitionOpps.clear();
+    batch->results.clear();
+    for (OutputBuffer& partitionOutput : batch->partitionOutput) partitionOutput.clear();
+    batch->numLines = 0;
+    batch->invalidOpps.clear();
+    return batch;
+}
+
+// Returns a written batch for reuse
+void releaseBatch(engine_state_t* state, engine_batch_t* batch) {
+    wait(&state->semLockFreeBatches);
+    state->freeBatches.push_back(batch);
+    post(&state->semLockFreeBatches);
+}
+
+// Adds an operation of batch to the list of its key's partition
+void route(engine_batch_t* batch, int oppIndex, int numPartitions) {
+    int partition = partitionOf(batch->opps[oppIndex].key, numPartitions);
+    batch->partitionOpps[partition].push_back(oppIndex);
+    batch->results.push_back({partition, 0, 0});
+}
+
+// Parses length bytes of whole lines into batch
+void parseLines(engine_state_t* state, engine_batch_t* batch, const char* lines, size_t length) {
+    unsigned long startTime = startTimer();
+    int numPartitions = state->partitions.size();
+    size_t start = 0;
+
+    while (start < length) {
+        const char* line = lines + start;
+        const char* lineEnd = (const char*)memchr(line, '\n', length - start);
+        size_t lineLength = lineEnd == nullptr ? length - start : lineEnd - line;
+        start += lineLength + 1;
+        int lineIndex = batch->numLines++;
+
+        if (lineLength == 0) continue;
+
+        int oppIndex = batch->opps.size();
+        batch->opps.emplace_back();
+        operation_t* opp = &batch->opps[oppIndex];
+        if (!parse(line, lineLength, opp)) {
+            setInvalid(opp, lineIndex);
+            batch->invalidOpps.push_back(oppIndex);
+        }
+        route(batch, oppIndex, numPartitions);
+    }
+
+    count(LINES_READ, batch->opps.size());
+    stopTimer(PARSE_NS, startTime);
+}
+
+// Decodes numOpps binary instructions starting at first into batch. Malformed lines already hold
+// their line number, so nothing is left to number at dispatch.
+void decodeOpps(engine_state_t* state, engine_batch_t* batch, uint64_t first, uint64_t numOpps) {
+    unsigned long startTime = startTimer();
+    int numPartitions = state->partitions.size();
+    batch->opps.resize(numOpps);
+    decodeOperations(state->binary, first, numOpps, batch->opps.data());
+    for (uint64_t i = 0; i < numOpps; i++) {
+        route(batch, i, numPartitions);
+    }
+    batch->numLines = numOpps;
+
+    count(LINES_READ, numOpps);
+    stopTimer(PARSE_NS, startTime);
+}
+
+// Claims the next unparsed chunk, parses it, and publishes it. Returns false if every chunk has
+// been claimed, or if the parsed batches are too far ahead of the writer.
+bool parseNextChunk(engine_state_t* state) {
+    long unsigned int chunk = state->nextChunk.load();
+    do {
+        if (chunk >= state->numChunks) return false;
+        if (chunk >= state->batchesWritten.load() + MAX_BATCHES_IN_FLIGHT) return false;
+    } while (!state->nextChunk.compare_exchange_weak(chunk, chunk + 1));
+
+    engine_batch_t* batch = newBatch(state, chunk);
+
+    if (state->binary != nullptr) {
+        uint64_t first = chunk * state->chunkOpps;
+        decodeOpps(state, batch, first, min(state->chunkOpps, state->binary->numOpps - first));
+    } else {
+        size_t chunkOffset = state->bodyStart + chunk * state->chunkBytes;
+        size_t start = lineStartAtOrAfter(state, chunkOffset);
+        size_t stop = lineStartAtOrAfter(state, chunkOffset + state->chunkBytes);
+        parseLines(state, batch, state->input + start, stop - start);
+    }
+
+    publish(state, batch);
+    return true;
+}
+
+// Runs a run of numOpps map operations in bulk and outputs each result as if it ran alone
+void executeBulk(engine_worker_t* worker, engine_batch_t* batch, int* oppIndexes, size_t numOpps,
+                 OutputBuffer* partitionOutput) {
+    vector<bulk_op_t>* bulkOpps = &worker->bulkOpps;
+    bulkOpps->resize(numOpps);
+    for (size_t i = 0; i < numOpps; i++) {
+        operation_t* opp = &batch->opps[oppIndexes[i]];
+        bulk_op_t* bulkOpp = &(*bulkOpps)[i];
+        bulkOpp->type = opp->type == INSERT   ? BULK_INSERT
+                        : opp->type == LOOKUP ? BULK_LOOKUP
+                                              : BULK_REMOVE;
+        bulkOpp->key = opp->key;
+        bulkOpp->value = opp->value;
+        bulkOpp->length = opp->valueLength;
+    }
+
+    worker->state->map->executeBulk(bulkOpps->data(), numOpps);
+
+    for (size_t i = 0; i < numOpps; i++) {
+        operation_t* opp = &batch->opps[oppIndexes[i]];
+        bulk_op_t* bulkOpp = &(*bulkOpps)[i];
+        batch_result_t* result = &batch->results[oppIndexes[i]];
+        result->start = partitionOutput->size();
+        if (opp->type == INSERT) {
+            count(INSERTS);
+            appendInsertResult(opp, bulkOpp->succeeded, partitionOutput);
+        } else if (opp->type == LOOKUP) {
+            count(LOOKUPS);
+            appendLookupResult(opp, bulkOpp->found, partitionOutput);
+        } else {
+            count(DELETES);
+            appendRemoveResult(opp, bulkOpp->succeeded, partitionOutput);
+        }
+        result->length = partitionOutput->size() - result->start;
+    }
+}
+
+// Runs a partition's operations in a batch and outputs the batch if it was the last to finish
+void executeBatch(engine_worker_t* worker, engine_batch_t* batch, int partition) {
+    unsigned long startTime = startTimer();
+    OutputBuffer* partitionOutput = &batch->partitionOutput[partition];
+    vector<int>* oppIndexes = &batch->partitionOpps[partition];
+    size_t next = 0;
+    while (next < oppIndexes->size()) {
+        size_t runEnd = next;
+        while (runEnd < oppIndexes->size() && isMapOperation(&batch->opps[(*oppIndexes)[runEnd]])) {
+            runEnd++;
+        }
+        if (runEnd - next >= MIN_BULK_OPPS) {
+            executeBulk(worker, batch, &(*oppIndexes)[next], runEnd - next, partitionOutput);
+            next = runEnd;
+            continue;
+        }
+
+        // The short run and the line after it run one at a time
+        size_t stop = min(runEnd + 1, oppIndexes->size());
+        for (; next < stop; next++) {
+            int i = (*oppIndexes)[next];
+            batch->results[i].start = partitionOutput->size();
+            runOperation(worker->state->map, &batch->opps[i], nullptr, partitionOutput);
+            batch->results[i].length = partitionOutput->size() - batch->results[i].start;
+        }
+    }
+    stopTimer(EXECUTE_NS, startTime);
+
+    // The last partition to finish hands the batch to the writer
+    if (--batch->remainingPartitions == 0) post(&slotOf(worker->state, batch->index)->semDone);
+}
+
+// Writes a finished batch's output in file order straight from its partitions' buffers.
+// Consecutive lines of the same partition are next to each other in its buffer, so they share an
+// iovec.
+void writeBatch(engine_batch_t* batch, vector<iovec>* buffers, output_sink_t* outputSink) {
+    buffers->clear();
+    for (batch_result_t& result : batch->results) {
+        char* start = (char*)batch->partitionOutput[result.partition].data() + result.start;
+        if (!buffers->empty() &&
+            (char*)buffers->back().iov_base + buffers->back().iov_len == start) {
+            buffers->back().iov_len += result.length;
+        } else {
+            buffers->push_back({start, result.length});
+        }
+    }
+    writeOutput(outputSink, buffers->data(), buffers->size());
+}
+
+// Runs the partition's oldest pending batch. If it has more, it goes to the back of the worker's
+// ready deque so every ready partition gets a turn before this one runs again.
+void runPartition(engine_worker_t* worker, int partitionIndex) {
+    engine_partition_t* partition = &worker->state->partitions[partitionIndex];
+
+    wait(&partition->semLock);
+    engine_batch_t* batch = partition->pending.front();
+    partition->pending.pop_front();
+    post(&partition->semLock);
+
+    executeBatch(worker, batch, partitionIndex);
+
+    wait(&partition->semLock);
+    bool hasMore = !partition->pending.empty();
+    if (!hasMore) partition->scheduled = false;
+    post(&partition->semLock);
+
+    if (hasMore) makeReady(worker, partitionIndex);
+}
+
+// Takes a ready partition from the front of the worker's own deque, or steals one from the back of
+// another worker's. Returns false if no partition is ready.
+bool takeReady(engine_worker_t* worker, int* partition) {
+    int numWorkers = worker->state->workers.size();
+    for (int i = 0; i < numWorkers; i++) {
+        engine_worker_t* victim = &worker->state->workers[(worker->id + i) % numWorkers];
+
+        wait(&victim->semLockReady);
+        bool found = !victim->ready.empty();
+        if (found && victim == worker) {
+            *partition = victim->ready.front();
+            victim->ready.pop_front();
+        } else if (found) {
+            *partition = victim->ready.back();
+            victim->ready.pop_back();
+        }
+        post(&victim->semLockReady);
+
+        if (found && victim != worker) count(STEALS);
+        if (found) return true;
+    }
+    return false;
+}
+
+// Runs ready partitions, stealing them from other workers when the worker's own run out.
+// When no partition is ready the worker helps parse the input.
+void* executePartitionThread(void* args) {
+    engine_worker_t* worker = (engine_worker_t*)args;
+    setCounterRole("worker");
+    if (worker->cpu != -1) pinThread(worker->cpu);
+
+    while (true) {
+        int partition;
+        if (takeReady(worker, &partition)) {
+            runPartition(worker, partition);
+            continue;
+        }
+
+        if (parseNextChunk(worker->state)) continue;
+        if (worker->state->finished) return 0;
+
+        unsigned long startTime = startTimer();
+        wait(&worker->state->semWork);
+        stopTimer(IDLE_NS, startTime);
+    }
+}
+
+struct engine_writer_t {
+    engine_state_t* state;
+
+    output_sink_t* outputSink;
+};
+
+// Writes the output of each batch in order as it finishes. Each write frees a slot, so it wakes a
+// worker that may have stopped parsing to wait for the writer.
+void* writeBatchesThread(void* args) {
+    engine_writer_t* writer = (engine_writer_t*)args;
+    engine_state_t* state = writer->state;
+    setCounterRole("writer");
+
+    vector<iovec> buffers;
+    for (long unsigned int i = 0; i < state->numChunks; i++) {
+        batch_slot_t* slot = slotOf(state, i);
+        wait(&slot->semDone);
+        writeBatch(slot->batch, &buffers, writer->outputSink);
+        releaseBatch(state, slot->batch);
+        state->batchesWritten++;
+        post(&state->semWork);
+    }
+    return 0;
+}
+
+// Stops the workers that were started before a thread failed to start. Without the writer the
+// workers stop parsing once the batches in flight fill up, so they all exit.
+void abortChunks(engine_state_t* state, vector<pthread_t>* threads) {
+    finishWorkers(state);
+    for (pthread_t& thread : *threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    // Batches that were parsed but never written are not on the free list
+    for (long unsigned int i = state->batchesWritten; i < state->nextChunk; i++) {
+        delete slotOf(state, i)->batch;
+    }
+}
+
+// Starts numWorkers workers that parse and run the chunks of state, and a writer that writes
+// their output, and waits for them to finish
+void runChunks(engine_state_t* state, int numWorkers, output_sink_t* outputSink) {
+    state->nextChunk = 0;
+    state->batchesWritten = 0;
+    state->parsedBatches.assign(MAX_BATCHES_IN_FLIGHT, nullptr);
+    state->nextBatchToDispatch = 0;
+    state->firstLine = FIRST_INSTRUCTION_LINE;
+    state->linesDispatched = 0;
+    init(&state->semLockDispatch, 1);
+
+    initWorkers(state, numWorkers);
+    initBatches(state);
+    if (state->numChunks == 0) finishWorkers(state);
+
+    // Workers start before the writer, so a failed start never leaves the writer waiting for
+    // batches that won't come
+    vector<pthread_t> threads;
+    bool started = true;
+    for (int i = 0; i < numWorkers && started; i++) {
+        pthread_t thread;
+        started =
+            pthread_create(&thread, nullptr, executePartitionThread, &state->workers[i]) == 0;
+        if (started) threads.push_back(thread);
+    }
+
+    engine_writer_t writer;
+    writer.state = state;
+    writer.outputSink = outputSink;
+    pthread_t writerThread;
+    if (started) {
+        started = pthread_create(&writerThread, nullptr, writeBatchesThread, &writer) == 0;
+    }
+
+    if (started) {
+        for (pthread_t& thread : threads) {
+            pthread_join(thread, nullptr);
+        }
+        pthread_join(writerThread, nullptr);
+    } else {
+        cerr << "Error starting thread\n";
+        abortChunks(state, &threads);
+    }
+
+    destroyBatches(state);
+    destroyWorkers(state);
+    sem_destroy(&state->semLockDispatch);
+}
+
+void executeBufferPartitioned(const char* input, size_t length, ConcurrentMap* map,
+                              output_sink_t* outputSink, size_t chunkBytes) {
+    // Get the first line which contains the number of threads to use
+    const char* threadsInfoEnd = (const char*)memchr(input, '\n', length);
+    size_t threadsInfoLength = threadsInfoEnd == nullptr ? length : threadsInfoEnd - input;
+    int numWorkers = parseThreadCount(input, threadsInfoLength);
+    if (numWorkers < 1) {
+        writeOutput(outputSink, MALFORMED_THREAD_COUNT.data(), MALFORMED_THREAD_COUNT.length());
+        return;
+    }
+    string threadsLine = "Using " + to_string(numWorkers) + " threads to consume\n";
+    writeOutput(outputSink, threadsLine.data(), threadsLine.length());
+
+    engine_state_t state;
+    state.map = map;
+    state.input = input;
+    state.length = length;
+    state.bodyStart = threadsInfoEnd == nullptr ? length : threadsInfoLength + 1;
+    state.chunkBytes = chunkBytes;
+    state.binary = nullptr;
+    state.numChunks = (length - state.bodyStart + chunkBytes - 1) / chunkBytes;
+    runChunks(&state, numWorkers, outputSink);
+}
+
+void executeBinaryPartitioned(binary_instructions_t* instructions, ConcurrentMap* map,
+                              output_sink_t* outputSink, uint64_t chunkOpps) {
+    int numWorkers = instructions->numThreads;
+    if (numWorkers < 1) {
+        writeOutput(outputSink, MALFORMED_THREAD_COUNT.data(), MALFORMED_THREAD_COUNT.length());
+        return;
+    }
+    string threadsLine = "Using " + to_string(numWorkers) + " threads to consume\n";
+    writeOutput(outputSink, threadsLine.data(), threadsLine.length());
+
+    engine_state_t state;
+    state.map = map;
+    state.binary = instructions;
+    state.chunkOpps = chunkOpps;
+    state.numChunks = (instructions->numOpps + chunkOpps - 1) / chunkOpps;
+    runChunks(&state, numWorkers, outputSink);
+}
+
+stringstream executeBufferPartitioned(const char* input, size_t length, ConcurrentMap* map,
+                                      size_t chunkBytes) {
+    stringstream outputBuffer;
+    output_sink_t outputSink = {-1, &outputBuffer, false};
+    executeBufferPartitioned(input, length, map, &outputSink, chunkBytes);
+    delete map;
+    return outputBuffer;
+}
+
+stringstream executeStreamPartitioned(stringstream* streamInput, ConcurrentMap* map) {
+    string input = streamInput->str();
+    return executeBufferPartitioned(input.data(), input.size(), map);
+}
+
+// Reads whole lines from a file descriptor
+struct stream_reader_t {
+    int fd;
+
+    // Bytes read after the last whole line
+    string pending;
+
+    bool ended;
+};
+
+// Sets chunk to the whole lines that can be read next, waiting for at least one unless the input
+// has ended. Lines are handed out as soon as they arrive so a slow stream isn't held back to fill
+// a chunk. Returns false once the input is exhausted.
+bool readChunk(stream_reader_t* reader, size_t chunkBytes, string* chunk) {
+    chunk->swap(reader->pending);
+    reader->pending.clear();
+
+    while (true) {
+        size_t lastLineEnd = chunk->rfind('\n');
+        if (lastLineEnd != string::npos) {
+            reader->pending.assign(*chunk, lastLineEnd + 1, string::npos);
+            chunk->resize(lastLineEnd + 1);
+            return true;
+        }
+
+        // The last line doesn't need a newline
+        if (reader->ended) return !chunk->empty();
+
+        size_t size = chunk->size();
+        chunk->resize(size + chunkBytes);
+        unsigned long startTime = startTimer();
+        ssize_t numRead = read(reader->fd, &(*chunk)[size], chunkBytes);
+        stopTimer(READ_NS, startTime);
+        if (numRead < 0) {
+            chunk->resize(size);
+            if (errno == EINTR) continue;
+            cerr << "Error reading input\n";
+            numRead = 0;
+        }
+        if (numRead == 0) reader->ended = true;
+        chunk->resize(size + numRead);
+    }
+}
+
+Mapper::Mapper(int numWorkers, ConcurrentMap* map) {
+    state = new engine_state_t;
+    state->map = map == nullptr ? new ConcurrentMap() : map;
+    ownsMap = true;
+    // No chunks are claimed by the workers, so idle workers wait for batches instead of parsing
+    state->input = nullptr;
+    state->length = 0;
+    state->bodyStart = 0;
+    state->chunkBytes = 0;
+    state->binary = nullptr;
+    state->numChunks = 0;
+    state->nextChunk = 0;
+    state->batchesWritten = 0;
+    state->nextBatchToDispatch = 0;
+    state->firstLine = 1;
+    state->linesDispatched = 0;
+    init(&state->semLockDispatch, 1);
+
+    initWorkers(state, numWorkers);
+    initBatches(state);
+
+    // Workers steal each other's partitions, so the ones that start run every partition
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, executePartitionThread, &state->workers[i]) != 0) {
+            cerr << "Error starting thread\n";
+            break;
+        }
+        threads.push_back(thread);
+    }
+}
+
+Mapper::~Mapper() {
+    finishWorkers(state);
+    for (pthread_t& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+    destroyBatches(state);
+    destroyWorkers(state);
+    sem_destroy(&state->semLockDispatch);
+
+    if (ownsMap) delete state->map;
+    delete state;
+}
+
+int Mapper::numWorkers() { return threads.size(); }
+
+ConcurrentMap* Mapper::getMap() { return state->map; }
+
+void Mapper::finishOldestBatch(deque<engine_batch_t*>* inFlight, output_sink_t* outputSink) {
+    engine_batch_t* batch = inFlight->front();
+    inFlight->pop_front();
+
+    wait(&slotOf(state, batch->index)->semDone);
+    writeBatch(batch, &writeBuffers, outputSink);
+    releaseBatch(state, batch);
+}
+
+engine_batch_t* Mapper::nextBatch(long unsigned int index, deque<engine_batch_t*>* inFlight,
+                                  output_sink_t* outputSink) {
+    // The oldest batch in flight uses the slot the next batch needs
+    if (inFlight->size() == MAX_BATCHES_IN_FLIGHT) finishOldestBatch(inFlight, outputSink);
+    return newBatch(state, index);
+}
+
+void Mapper::submit(engine_batch_t* batch, deque<engine_batch_t*>* inFlight) {
+    inFlight->push_back(batch);
+    dispatch(state, batch);
+
+    // Without worker threads the caller runs the batch as the first worker
+    int partition;
+    while (threads.empty() && takeReady(&state->workers[0], &partition)) {
+        runPartition(&state->workers[0], partition);
+    }
+}
+
+void Mapper::startRun(long unsigned int firstLine) {
+    state->firstLine = firstLine;
+    state->linesDispatched = 0;
+}
+
+void Mapper::execute(const char* input, size_t length, output_sink_t* outputSink,
+                     size_t chunkBytes) {
+    startRun(1);
+    state->input = input;
+    state->length = length;
+
+    deque<engine_batch_t*> inFlight;
+    long unsigned int numBatches = 0;
+    for (size_t start = 0; start < length;) {
+        size_t stop = lineStartAtOrAfter(state, start + chunkBytes);
+        engine_batch_t* batch = nextBatch(numBatches++, &inFlight, outputSink);
+        parseLines(state, batch, input + start, stop - start);
+        submit(batch, &inFlight);
+        start = stop;
+    }
+
+    while (!inFlight.empty()) finishOldestBatch(&inFlight, outputSink);
+    state->input = nullptr;
+    state->length = 0;
+}
+
+string Mapper::execute(string input) {
+    stringstream outputBuffer;
+    output_sink_t outputSink = {-1, &outputBuffer, false};
+    execute(input.data(), input.size(), &outputSink);
+    return outputBuffer.str();
+}
+
+void Mapper::executeStream(stream_reader_t* reader, string* chunk, output_sink_t* outputSink,
+                           size_t chunkBytes) {
+    // Batches are read in order, so each is dispatched as soon as it is parsed
+    deque<engine_batch_t*> inFlight;
+    long unsigned int numBatches = 0;
+    do {
+        if (chunk->empty()) continue;
+        engine_batch_t* batch = nextBatch(numBatches++, &inFlight, outputSink);
+        batch->input.swap(*chunk);
+        parseLines(state, batch, batch->input.data(), batch->input.size());
+        submit(batch, &inFlight);
+    } while (readChunk(reader, chunkBytes, chunk));
+
+    while (!inFlight.empty()) finishOldestBatch(&inFlight, outputSink);
+}
+
+void Mapper::executeFd(int fdInput, output_sink_t* outputSink, size_t chunkBytes) {
+    startRun(1);
+    stream_reader_t reader = {fdInput, "", false};
+    string chunk;
+    executeStream(&reader, &chunk, outputSink, chunkBytes);
+}
+
+void executeFdPartitioned(int fdInput, ConcurrentMap* map, output_sink_t* outputSink,
+                          size_t chunkBytes) {
+    stream_reader_t reader = {fdInput, "", false};
+    string chunk;
+    readChunk(&reader, chunkBytes, &chunk);
+
+    // Get the first line which contains the number of threads to use
+    size_t threadsInfoLength = min(chunk.find('\n'), chunk.size());
+    int numWorkers = parseThreadCount(chunk.data(), threadsInfoLength);
+    if (numWorkers < 1) {
+        writeOutput(outputSink, MALFORMED_THREAD_COUNT.data(), MALFORMED_THREAD_COUNT.length());
+        return;
+    }
+    string threadsLine = "Using " + to_string(numWorkers) + " threads to consume\n";
+    writeOutput(outputSink, threadsLine.data(), threadsLine.length());
+    chunk.erase(0, threadsInfoLength + 1);
+
+    Mapper mapper(numWorkers, map);
+    mapper.ownsMap = false;
+    mapper.startRun(FIRST_INSTRUCTION_LINE);
+    mapper.executeStream(&reader, &chunk, outputSink, chunkBytes);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BinaryInstructions.h"
+#include "ConcurrentMap.h"
+#include "OutputBuffer.h"
+
+using namespace std;
+
+// Number of input bytes a worker claims to parse at a time
+const size_t DEFAULT_CHUNK_BYTES = 1 << 20;
+
+// Most input bytes read from a stream at a time, which is the default capacity of a pipe
+const size_t STREAM_CHUNK_BYTES = 1 << 16;
+
+// Number of binary instructions a worker claims to decode at a time
+const uint64_t BINARY_CHUNK_OPPS = 1 << 16;
+
+// Returns which of numPartitions partitions key belongs to
+int partitionOf(int key, int numPartitions);
+
+// Runs the instructions in input by routing each operation to the partition of its key.
+// Operations on the same key run in file order while operations on different keys run in parallel.
+// Each worker runs the partitions that start on it and steals ready partitions from busy workers
+// once its own run out, so skewed keys don't leave workers idle.
+// Workers parse the input in place, claiming chunks of chunkBytes aligned on line starts.
+// Writes the output to outputSink in order as batches finish. The caller keeps map.
+void executeBufferPartitioned(const char* input, size_t length, ConcurrentMap* map,
+                              output_sink_t* outputSink, size_t chunkBytes = DEFAULT_CHUNK_BYTES);
+
+stringstream executeBufferPartitioned(const char* input, size_t length, ConcurrentMap* map,
+                                      size_t chunkBytes = DEFAULT_CHUNK_BYTES);
+
+// Runs binary instructions the same way, with workers claiming chunks of chunkOpps instructions.
+// The caller keeps map and the memory instructions points into.
+void executeBinaryPartitioned(binary_instructions_t* instructions, ConcurrentMap* map,
+                              output_sink_t* outputSink, uint64_t chunkOpps = BINARY_CHUNK_OPPS);
+
+// Runs the instructions read from fdInput, which can be a pipe, as they arrive. Input is parsed
+// and dispatched in chunks of up to chunkBytes of whole lines, and reading waits while the workers
+// are behind, so memory use doesn't grow with the length of the input. The caller keeps map.
+void executeFdPartitioned(int fdInput, ConcurrentMap* map, output_sink_t* outputSink,
+                          size_t chunkBytes = STREAM_CHUNK_BYTES);
+
+stringstream executeStreamPartitioned(stringstream* streamInput, ConcurrentMap* map);
+
+struct engine_state_t;
+
+struct engine_batch_t;
+
+struct stream_reader_t;
+
+// Long-lived partitioned engine that keeps its workers and map between inputs, so many small
+// inputs can be run without starting and stopping threads for each one. The calling thread parses
+// the input and writes the output while the workers run the operations.
+class Mapper {
+  private:
+    engine_state_t* state;
+
+    vector<pthread_t> threads;
+
+    // Whether the map is deleted with the Mapper
+    bool ownsMap;
+
+    // Reused to write each batch
+    vector<iovec> writeBuffers;
+
+    // Waits for the oldest batch in flight and writes its output
+    void finishOldestBatch(deque<engine_batch_t*>* inFlight, output_sink_t* outputSink);
+
+    // Returns an empty batch to parse the next chunk into, once its slot is free
+    engine_batch_t* nextBatch(long unsigned int index, deque<engine_batch_t*>* inFlight,
+                              output_sink_t* outputSink);
+
+    // Hands a parsed batch to the workers
+    void submit(engine_batch_t* batch, deque<engine_batch_t*>* inFlight);
+
+    // Numbers lines of the next input from firstLine
+    void startRun(long unsigned int firstLine);
+
+    // Runs chunk and then the rest of the stream
+    void executeStream(stream_reader_t* reader, string* chunk, output_sink_t* outputSink,
+                       size_t chunkBytes);
+
+    friend void executeFdPartitioned(int fdInput, ConcurrentMap* map, output_sink_t* outputSink,
+                                     size_t chunkBytes);
+
+  public:
+    // Starts numWorkers workers running operations on map, or a default map if it is nullptr.
+    // The map is deleted with the Mapper. If the system runs out of threads, numWorkers() is how
+    // many started, and with none the calling thread runs the operations.
+    Mapper(int numWorkers, ConcurrentMap* map = nullptr);
+
+    ~Mapper();
+
+    // Runs the instructions in input and writes the output to outputSink in order. Unlike a file,
+    // input has no thread count line, and malformed lines are numbered from its first line.
+    // The map keeps its contents for the next input.
+    void execute(const char* input, size_t length, output_sink_t* outputSink,
+                 size_t chunkBytes = DEFAULT_CHUNK_BYTES);
+
+    string execute(string input);
+
+    // Runs the instructions read from fdInput as they arrive
+    void executeFd(int fdInput, output_sink_t* outputSink,
+                   size_t chunkBytes = STREAM_CHUNK_BYTES);
+
+    int numWorkers();
+
+    ConcurrentMap* getMap();
+};
@@ -0,0 +1,150 @@
+#include "Operation.h"
+
+#include <climits>
+#include <string>
+
+#include "Counters.h"
+#include "Semaphore.h"
+
+bool parse(const char* line, size_t length, operation_t* opp) {
+    opp->value = nullptr;
+    opp->valueLength = 0;
+
+    // Shortest line is a type, a space, and one digit
+    if (length < 3 || line[1] != ' ') return false;
+
+    switch (line[0]) {
+        case 'I':
+            opp->type = INSERT;
+            break;
+        case 'L':
+            opp->type = LOOKUP;
+            break;
+        case 'D':
+            opp->type = DELETE;
+            break;
+        case 'N':
+            opp->type = THREADS;
+            break;
+        default:
+            return false;
+    }
+
+    size_t i = 2;
+    bool negative = line[i] == '-';
+    if (negative) i++;
+
+    // Accumulate as a negative number so INT_MIN fits
+    size_t digitsStart = i;
+    long long key = 0;
+    while (i < length && line[i] >= '0' && line[i] <= '9') {
+        key = key * 10 - (line[i] - '0');
+        if (key < INT_MIN) return false;
+        i++;
+    }
+    if (i == digitsStart) return false;
+    if (!negative) {
+        if (key < -INT_MAX) return false;
+        key = -key;
+    }
+    opp->key = key;
+
+    // Lookups, deletes, and thread counts end after the key
+    if (opp->type != INSERT) return i == length;
+
+    // The value is everything between the quote after the key and the quote ending the line
+    if (length < i + 3 || line[i] != ' ' || line[i + 1] != '"' || line[length - 1] != '"') {
+        return false;
+    }
+    opp->value = line + i + 2;
+    opp->valueLength = length - i - 3;
+    return true;
+}
+
+void setInvalid(operation_t* opp, int lineNumber) {
+    opp->type = INVALID;
+    opp->key = lineNumber;
+    opp->value = nullptr;
+    opp->valueLength = 0;
+}
+
+bool isMapOperation(operation_t* opp) {
+    return opp->type == INSERT || opp->type == LOOKUP || opp->type == DELETE;
+}
+
+void runOperation(ConcurrentMap* map, operation_t* opp, sem_t* semOppStarted,
+                  OutputBuffer* output) {
+    if (opp->type == DELETE) {
+        count(DELETES);
+        bool success = map->removeAndPost(opp->key, semOppStarted);
+        appendRemoveResult(opp, success, output);
+    } else if (opp->type == LOOKUP) {
+        count(LOOKUPS);
+        // Reused by each thread so lookups stop allocating once values fit
+        static thread_local string value;
+        map->lookupAndPost(opp->key, &value, semOppStarted);
+        appendLookupResult(opp, value, output);
+    } else if (opp->type == INSERT) {
+        count(INSERTS);
+        bool success = map->insertAndPost(opp->key, opp->value, opp->valueLength, semOppStarted);
+        appendInsertResult(opp, success, output);
+    } else {
+        // Lines that don't touch the map still give up their turn
+        if (semOppStarted != nullptr) post(semOppStarted);
+
+        if (opp->type == INVALID) {
+            count(MALFORMED_LINES);
+            output->append("[Error] malformed instruction on line ");
+            output->appendInt(opp->key);
+            output->append("\n");
+        }
+    }
+}
+
+void appendInsertResult(operation_t* opp, bool success, OutputBuffer* output) {
+    if (success) {
+        output->append("[Success] inserted ");
+        output->append(opp->value, opp->valueLength);
+        output->append(" at ");
+        output->appendInt(opp->key);
+        output->append("\n");
+    } else {
+        output->append("[Error] failed to insert ");
+        output->appendInt(opp->key);
+        output->append(" at ");
+        output->append(opp->value, opp->valueLength);
+        output->append("\n");
+    }
+}
+
+void appendRemoveResult(operation_t* opp, bool success, OutputBuffer* output) {
+    if (success) {
+        output->append("[Success] removed ");
+        output->appendInt(opp->key);
+        output->append("\n");
+    } else {
+        output->append("[Error] failed to remove ");
+        output->appendInt(opp->key);
+        output->append(": value not found\n");
+    }
+}
+
+void appendLookupResult(operation_t* opp, const string& value, OutputBuffer* output) {
+    if (value != "") {
+        output->append("[Success] Found \"");
+        output->append(value.data(), value.length());
+        output->append("\" from key ");
+        output->appendInt(opp->key);
+        output->append("\n");
+    } else {
+        output->append("[Error] failed to locate ");
+        output->appendInt(opp->key);
+        output->append("\n");
+    }
+}
+
+int parseThreadCount(const char* line, size_t length) {
+    operation_t opp;
+    if (!parse(line, length, &opp) || opp.type != THREADS || opp.key < 1) return -1;
+    return opp.key;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <semaphore.h>
+
+#include <cstddef>
+#include <string>
+
+#include "ConcurrentMap.h"
+#include "OutputBuffer.h"
+
+using namespace std;
+
+enum operation_type_t {
+    INSERT,
+    LOOKUP,
+    DELETE,
+    // Thread count line
+    THREADS,
+    // Line that failed to parse
+    INVALID,
+};
+
+// File line number of the first instruction after the thread count line
+const int FIRST_INSTRUCTION_LINE = 2;
+
+// Output when the first line of an instruction file is not a thread count
+const string MALFORMED_THREAD_COUNT = "[Error] malformed thread count on line 1\n";
+
+// Fixed-size instruction record. Inserts point at their value in the parsed input, so the input
+// must outlive the record
+struct operation_t {
+    operation_type_t type;
+
+    // Map key, thread count for THREADS, or line number for INVALID
+    int key;
+
+    const char* value;
+
+    int valueLength;
+};
+
+// Decodes one instruction line of length bytes, not counting the newline, without allocating.
+// Returns false if the line is malformed
+bool parse(const char* line, size_t length, operation_t* opp);
+
+// Marks opp as a malformed line so running it reports lineNumber
+void setInvalid(operation_t* opp, int lineNumber);
+
+// Returns true for inserts, lookups, and deletes, which touch the map at their key
+bool isMapOperation(operation_t* opp);
+
+// Runs an operation on map and appends the result to output.
+// semOppStarted is posted once the map has locked the operation's bucket, or may be nullptr
+void runOperation(ConcurrentMap* map, operation_t* opp, sem_t* semOppStarted,
+                  OutputBuffer* output);
+
+// Appends the result of an operation on the map that has already run, so operations run in bulk
+// output the same as operations run by runOperation
+void appendInsertResult(operation_t* opp, bool success, OutputBuffer* output);
+
+void appendRemoveResult(operation_t* opp, bool success, OutputBuffer* output);
+
+// value is empty if the key wasn't found
+void appendLookupResult(operation_t* opp, const string& value, OutputBuffer* output);
+
+// Parses the number of threads from the first line of an instruction file.
+// Returns -1 if the line is not a thread count of at least 1
+int parseThreadCount(const char* line, size_t length);
@@ -0,0 +1,96 @@
+#include "OutputBuffer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "Counters.h"
+
+OutputBuffer::OutputBuffer() { length = 0; }
+
+void OutputBuffer::append(const char* data, size_t size) {
+    if (length + size > bytes.size()) {
+        bytes.resize(max(length + size, bytes.size() * 2));
+    }
+    memcpy(bytes.data() + length, data, size);
+    length += size;
+}
+
+void OutputBuffer::appendInt(int value) {
+    // Enough for INT_MIN
+    char digits[11];
+    int start = sizeof(digits);
+
+    // Negate as unsigned so INT_MIN doesn't overflow
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : value;
+    do {
+        digits[--start] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) digits[--start] = '-';
+
+    append(digits + start, sizeof(digits) - start);
+}
+
+const char* OutputBuffer::data() { return bytes.data(); }
+
+size_t OutputBuffer::size() { return length; }
+
+void OutputBuffer::clear() { length = 0; }
+
+void OutputBuffer::shrink(size_t maxCapacity) {
+    if (bytes.size() > maxCapacity) vector<char>().swap(bytes);
+}
+
+void OutputBuffer::swap(OutputBuffer* other) {
+    bytes.swap(other->bytes);
+    std::swap(length, other->length);
+}
+
+bool writeOutput(output_sink_t* sink, iovec* buffers, int count) {
+    if (sink->failed) return false;
+
+    unsigned long startTime = startTimer();
+    if (sink->fd == -1) {
+        for (int i = 0; i < count; i++) {
+            sink->stream->write((const char*)buffers[i].iov_base, buffers[i].iov_len);
+        }
+        stopTimer(WRITE_NS, startTime);
+        sink->failed = sink->stream->fail();
+        return !sink->failed;
+    }
+
+    while (count > 0) {
+        ssize_t written = writev(sink->fd, buffers, min(count, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            // Output may be going to stdout, so errors go to stderr
+            cerr << "Error writing output\n";
+            stopTimer(WRITE_NS, startTime);
+            sink->failed = true;
+            return false;
+        }
+
+        // Skip what was written, which can end partway through a buffer
+        while (count > 0 && (size_t)written >= buffers->iov_len) {
+            written -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers->iov_base = (char*)buffers->iov_base + written;
+            buffers->iov_len -= written;
+        }
+    }
+    stopTimer(WRITE_NS, startTime);
+    return true;
+}
+
+bool writeOutput(output_sink_t* sink, const char* data, size_t size) {
+    iovec buffer = {(void*)data, size};
+    return writeOutput(sink, &buffer, 1);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+
+// Growable byte buffer for formatting output. Clearing keeps the capacity, so a reused buffer
+// stops allocating once it has grown to fit its largest output.
+class OutputBuffer {
+  private:
+    // Only the first length bytes hold output, the rest is spare capacity
+    vector<char> bytes;
+
+    size_t length;
+
+  public:
+    OutputBuffer();
+
+    void append(const char* data, size_t size);
+
+    // Appends a string literal without measuring it
+    template <size_t N>
+    void append(const char (&text)[N]) {
+        append(text, N - 1);
+    }
+
+    // Appends value in decimal
+    void appendInt(int value);
+
+    const char* data();
+
+    size_t size();
+
+    void clear();
+
+    // Frees the capacity if it is over maxCapacity, so a buffer that held one large output
+    // doesn't keep it
+    void shrink(size_t maxCapacity);
+
+    void swap(OutputBuffer* other);
+};
+
+// Where finished output goes: the file descriptor, or the stream if fd is -1
+struct output_sink_t {
+    int fd;
+
+    ostream* stream;
+
+    // Set once a write fails, after which nothing more is written
+    bool failed;
+};
+
+// Writes the buffers to sink in order, with as few system calls as possible. Returns false if
+// they couldn't all be written, or an earlier write to sink failed.
+bool writeOutput(output_sink_t* sink, iovec* buffers, int count);
+
+bool writeOutput(output_sink_t* sink, const char* data, size_t size);
@@ -0,0 +1,98 @@
+#include "ReorderBuffer.h"
+
+#include <sys/uio.h>
+
+#include <limits>
+
+// Drained result buffers bigger than this are freed instead of going back to the producers
+const size_t MAX_POOLED_RESULT_BYTES = 1 << 16;
+
+ReorderBuffer::ReorderBuffer(int capacity) : slots(capacity), filled(capacity, false) {
+    next = 0;
+    total = numeric_limits<long unsigned int>::max();
+    pthread_mutex_init(&lock, nullptr);
+    pthread_cond_init(&condNextReady, nullptr);
+    pthread_cond_init(&condSpace, nullptr);
+}
+
+ReorderBuffer::~ReorderBuffer() {
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&condNextReady);
+    pthread_cond_destroy(&condSpace);
+}
+
+void ReorderBuffer::put(long unsigned int index, OutputBuffer* result) {
+    pthread_mutex_lock(&lock);
+
+    // Wait until the writer has drained the result that used this slot last
+    while (index >= next + slots.size()) {
+        pthread_cond_wait(&condSpace, &lock);
+    }
+
+    int slot = index % slots.size();
+    slots[slot].swap(result);
+    result->clear();
+    filled[slot] = true;
+
+    if (index == next) pthread_cond_signal(&condNextReady);
+
+    pthread_mutex_unlock(&lock);
+}
+
+void ReorderBuffer::close(long unsigned int index) {
+    pthread_mutex_lock(&lock);
+
+    if (index < total) total = index;
+    pthread_cond_signal(&condNextReady);
+
+    pthread_mutex_unlock(&lock);
+}
+
+void ReorderBuffer::drain(output_sink_t* sink) {
+    // Cleared buffers that are swapped into the slots as results are taken out
+    vector<OutputBuffer> run;
+    vector<iovec> runBuffers;
+
+    pthread_mutex_lock(&lock);
+
+    while (true) {
+        while (next < total && !filled[next % slots.size()]) {
+            pthread_cond_wait(&condNextReady, &lock);
+        }
+
+        if (next >= total) break;
+
+        // Take every result that is ready in order
+        size_t runLength = 0;
+        while (next < total && filled[next % slots.size()]) {
+            int slot = next % slots.size();
+            if (runLength == run.size()) run.emplace_back();
+            run[runLength].swap(&slots[slot]);
+            runLength++;
+            filled[slot] = false;
+            next++;
+        }
+
+        // Slots were freed so let blocked producers recheck
+        pthread_cond_broadcast(&condSpace);
+
+        pthread_mutex_unlock(&lock);
+        runBuffers.resize(runLength);
+        for (size_t i = 0; i < runLength; i++) {
+            runBuffers[i] = {(void*)run[i].data(), run[i].size()};
+        }
+        writeOutput(sink, runBuffers.data(), runLength);
+        for (size_t i = 0; i < runLength; i++) {
+            run[i].clear();
+            run[i].shrink(MAX_POOLED_RESULT_BYTES);
+        }
+        pthread_mutex_lock(&lock);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+void ReorderBuffer::drain(ostream* output) {
+    output_sink_t sink = {-1, output, false};
+    drain(&sink);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <ostream>
+#include <vector>
+
+#include "OutputBuffer.h"
+
+using namespace std;
+
+// Puts results that finish out of order back into order.
+// Producers drop a result into the slot of its sequence number and a single writer drains
+// completed runs in order. Producers only block when they get too far ahead of the writer.
+// Results are swapped in and out of the slots rather than copied, so their buffers get reused.
+class ReorderBuffer {
+  private:
+    vector<OutputBuffer> slots;
+
+    vector<bool> filled;
+
+    // Sequence number of the next result to write
+    long unsigned int next;
+
+    // Number of results, known once the producers reach the end of the input
+    long unsigned int total;
+
+    pthread_mutex_t lock;
+
+    // Signals the writer when the next result is ready or the buffer is closed
+    pthread_cond_t condNextReady;
+
+    // Signals producers waiting for a free slot
+    pthread_cond_t condSpace;
+
+  public:
+    ReorderBuffer(int capacity);
+
+    ~ReorderBuffer();
+
+    // Stores the result with the given sequence number. result is swapped for an empty buffer.
+    void put(long unsigned int index, OutputBuffer* result);
+
+    // Marks that there are no results at or after index
+    void close(long unsigned int index);
+
+    // Writes results in order until the buffer is closed and empty.
+    // Each run of ready results is written at once.
+    void drain(output_sink_t* sink);
+
+    void drain(ostream* output);
+};
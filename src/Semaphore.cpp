@@ -1,7 +1,11 @@
 #include "Semaphore.h"
 
+#include <unistd.h>
+
 #include <iostream>
 
+#include "Counters.h"
+
 void post(sem_t* sem) {
     while (sem_post(sem) != 0) {
         std::cout << "Error posting sem\n";
@@ -14,6 +18,15 @@ void wait(sem_t* sem) {
     }
 }
 
+const int WAIT_SPINS = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 64 : 0;
+
+void waitAdaptive(sem_t* sem) {
+    if (spinThenYield([sem] { return sem_trywait(sem) == 0; })) return;
+
+    count(WAITS_SLEPT);
+    wait(sem);
+}
+
 void init(sem_t* sem, int value) {
     while (sem_init(sem, 0, value) != 0) {
         std::cout << "Error initializing sem\n";
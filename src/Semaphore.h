@@ -1,3 +1,6 @@
+#pragma once
+
+#include <sched.h>
 #include <semaphore.h>
 
 void post(sem_t*);
@@ -6,3 +9,36 @@ void wait(sem_t*);
 
 void init(sem_t*, int value);
 
+// Times a waiter checks with a pause between checks before it starts yielding its core. Zero on a
+// single CPU, where nothing can change while the waiter holds the core.
+extern const int WAIT_SPINS;
+
+// Times a waiter yields its core before it sleeps
+const int WAIT_YIELDS = 8;
+
+// Tells the CPU the thread is spinning, so a sibling hyperthread gets the core meanwhile
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Checks done with a pause between checks, then yielding between checks. Returns false if done is
+// still false, so the caller should sleep.
+template <typename Done>
+bool spinThenYield(Done done) {
+    for (int i = 0; i < WAIT_SPINS; i++) {
+        if (done()) return true;
+        cpuRelax();
+    }
+    for (int i = 0; i < WAIT_YIELDS; i++) {
+        if (done()) return true;
+        sched_yield();
+    }
+    return false;
+}
+
+// Takes sem after spinning briefly, then yielding, then sleeping, for waits that are usually short
+// but may not be when there are more threads than cores
+void waitAdaptive(sem_t*);
+
@@ -0,0 +1,54 @@
+#include "Sequence.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Counters.h"
+#include "Semaphore.h"
+
+Sequence::Sequence(unsigned long value) {
+    this->value = value;
+    for (sequence_slot_t& slot : slots) {
+        slot.wakes = 0;
+        slot.numSleepers = 0;
+    }
+}
+
+unsigned long Sequence::load() { return value.load(memory_order_acquire); }
+
+void Sequence::waitFor(unsigned long target) {
+    if (spinThenYield([this, target] { return load() == target; })) return;
+
+    count(WAITS_SLEPT);
+    sleep(target);
+}
+
+void Sequence::sleep(unsigned long target) {
+    sequence_slot_t* slot = &slots[target % NUM_SLOTS];
+    while (true) {
+        uint32_t wakes = slot->wakes.load();
+        // Registering before checking the value pairs with advance changing the value before
+        // checking for sleepers, so one of them always sees the other
+        slot->numSleepers++;
+        if (value.load() == target) {
+            slot->numSleepers--;
+            return;
+        }
+
+        // Returns right away if a wake came after wakes was read
+        syscall(SYS_futex, &slot->wakes, FUTEX_WAIT_PRIVATE, wakes, nullptr, nullptr, 0);
+        slot->numSleepers--;
+        if (value.load() == target) return;
+    }
+}
+
+void Sequence::advance() {
+    unsigned long next = ++value;
+    sequence_slot_t* slot = &slots[next % NUM_SLOTS];
+    if (slot->numSleepers.load() == 0) return;
+
+    slot->wakes++;
+    // Values a multiple of the slot count apart share the futex, so every sleeper checks its own
+    syscall(SYS_futex, &slot->wakes, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
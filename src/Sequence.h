@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+// Number that threads wait on to reach their own value, like the line whose turn it is.
+// Waiters spin briefly, then yield, then sleep on a futex picked by the value they wait for, so
+// they give up their cores when there are more threads than cores and only the waiter for the
+// next value is woken.
+class Sequence {
+  private:
+    // Waiters for values that share a slot sleep on its futex word
+    static const int NUM_SLOTS = 64;
+
+    struct alignas(64) sequence_slot_t {
+        // Bumped for each wake, so a waiter that saw an older count doesn't go to sleep
+        atomic<uint32_t> wakes;
+
+        atomic<int> numSleepers;
+    };
+
+    atomic<unsigned long> value;
+
+    sequence_slot_t slots[NUM_SLOTS];
+
+    void sleep(unsigned long target);
+
+  public:
+    Sequence(unsigned long value = 0);
+
+    unsigned long load();
+
+    // Returns once the sequence reaches target
+    void waitFor(unsigned long target);
+
+    // Moves the sequence to the next value and wakes its waiters
+    void advance();
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "Epoch.h"
+
+using namespace std;
+
+// Smallest and largest number of objects in one block of a slab
+const int MIN_SLAB_BLOCK = 8;
+const int MAX_SLAB_BLOCK = 1024;
+
+// Single-owner allocator for objects of type T. Objects come from blocks that grow as the slab
+// fills, freed objects are reused through a free list, and the blocks are only released when
+// the slab is destroyed. The slab doesn't construct or destroy objects.
+template <typename T>
+class Slab {
+  private:
+    // A free slot holds the link to the next free slot in place of the object
+    union slot_t {
+        slot_t* nextFree;
+
+        alignas(T) char object[sizeof(T)];
+    };
+
+    struct retired_slot_t {
+        slot_t* slot;
+
+        // Epoch the slot was retired in
+        unsigned long epoch;
+    };
+
+    vector<slot_t*> blocks;
+
+    int nextBlockSize;
+
+    // Slots in every block
+    size_t numSlots;
+
+    slot_t* freeList;
+
+    // Retired slots in the order they were retired, waiting for readers to move on.
+    // Kept outside the slots since readers may still be reading them.
+    deque<retired_slot_t> limbo;
+
+    void pushFree(slot_t* slot) {
+        slot->nextFree = freeList;
+        freeList = slot;
+    }
+
+    // Moves retired slots that no reader can still hold to the free list
+    void recycleLimbo() {
+        while (!limbo.empty() && epochPassed(limbo.front().epoch)) {
+            pushFree(limbo.front().slot);
+            limbo.pop_front();
+        }
+    }
+
+  public:
+    Slab() {
+        nextBlockSize = MIN_SLAB_BLOCK;
+        numSlots = 0;
+        freeList = nullptr;
+    }
+
+    ~Slab() {
+        for (slot_t* block : blocks) {
+            delete[] block;
+        }
+    }
+
+    // Returns uninitialized memory for one T
+    T* allocate() {
+        if (freeList == nullptr && !limbo.empty()) recycleLimbo();
+
+        if (freeList == nullptr) {
+            slot_t* block = new slot_t[nextBlockSize];
+            blocks.push_back(block);
+            numSlots += nextBlockSize;
+            for (int i = nextBlockSize - 1; i >= 0; i--) {
+                pushFree(&block[i]);
+            }
+            if (nextBlockSize < MAX_SLAB_BLOCK) nextBlockSize *= 2;
+        }
+
+        slot_t* slot = freeList;
+        freeList = slot->nextFree;
+        return (T*)slot->object;
+    }
+
+    // Makes object's memory available again right away
+    void release(T* object) { pushFree((slot_t*)object); }
+
+    // Makes object's memory available once no epoch reader can still hold it
+    void retire(T* object) { limbo.push_back({(slot_t*)object, epochCurrent()}); }
+
+    size_t memoryBytes() {
+        return numSlots * sizeof(slot_t) + blocks.capacity() * sizeof(slot_t*) +
+               limbo.size() * sizeof(retired_slot_t);
+    }
+};
@@ -0,0 +1,210 @@
+#include "Snapshot.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "MappedFile.h"
+#include "OutputBuffer.h"
+
+const char SNAPSHOT_MAGIC[8] = {'M', 'A', 'P', 'S', 'N', 'A', 'P', '1'};
+
+// Bytes of entries collected before they are written
+const size_t SNAPSHOT_WRITE_BYTES = 1 << 20;
+
+// Entries inserted into the map at a time while reading a snapshot
+const size_t SNAPSHOT_BULK_INSERTS = 1 << 16;
+
+const size_t SNAPSHOT_HEADER_BYTES = sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t);
+
+struct snapshot_writer_t {
+    output_sink_t sink;
+
+    OutputBuffer buffer;
+
+    uint64_t numEntries;
+
+    // Set once a write fails, after which entries are skipped
+    bool failed;
+};
+
+void writeEntry(int key, const char* value, size_t length, void* context) {
+    snapshot_writer_t* writer = (snapshot_writer_t*)context;
+    if (writer->failed) return;
+
+    int32_t entryKey = key;
+    uint32_t entryLength = length;
+    writer->buffer.append((const char*)&entryKey, sizeof(entryKey));
+    writer->buffer.append((const char*)&entryLength, sizeof(entryLength));
+    writer->buffer.append(value, length);
+    writer->numEntries++;
+
+    if (writer->buffer.size() >= SNAPSHOT_WRITE_BYTES) {
+        writer->failed = !writeOutput(&writer->sink, writer->buffer.data(), writer->buffer.size());
+        writer->buffer.clear();
+    }
+}
+
+bool writeSnapshot(ConcurrentMap* map, string path) {
+    string pathWriting = path + ".tmp";
+    int fd = open(pathWriting.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        cerr << "Error opening snapshot\n";
+        return false;
+    }
+
+    snapshot_writer_t writer;
+    writer.sink = {fd, nullptr, false};
+    writer.numEntries = 0;
+    writer.failed = false;
+
+    // The count is filled in once every entry has been written
+    char header[SNAPSHOT_HEADER_BYTES] = {};
+    memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writer.buffer.append(header, sizeof(header));
+
+    map->visit(writeEntry, &writer);
+    bool written = !writer.failed &&
+                   writeOutput(&writer.sink, writer.buffer.data(), writer.buffer.size()) &&
+                   pwrite(fd, &writer.numEntries, sizeof(writer.numEntries),
+                          sizeof(SNAPSHOT_MAGIC)) == sizeof(writer.numEntries);
+    // Synced before the rename, so a crash can't leave path naming a snapshot that was never
+    // written out
+    if (written && fsync(fd) != 0) written = false;
+    if (close(fd) != 0) written = false;
+    if (written && rename(pathWriting.c_str(), path.c_str()) != 0) written = false;
+
+    if (!written) {
+        unlink(pathWriting.c_str());
+        cerr << "Error writing snapshot\n";
+    }
+    return written;
+}
+
+// Entries of a snapshot, from start up to end, that one thread inserts into map
+struct snapshot_range_t {
+    ConcurrentMap* map;
+
+    const char* data;
+
+    size_t start;
+
+    size_t end;
+};
+
+// Reads the key and value length of the entry at offset. Returns false if they or the value run
+// past size.
+bool readEntryHeader(const char* data, size_t size, size_t offset, int32_t* key,
+                     uint32_t* length) {
+    if (size - offset < sizeof(*key) + sizeof(*length)) return false;
+    memcpy(key, data + offset, sizeof(*key));
+    memcpy(length, data + offset + sizeof(*key), sizeof(*length));
+    return size - offset - sizeof(*key) - sizeof(*length) >= *length;
+}
+
+// Inserts the entries of a range, which has already been checked, in bulk
+void* loadRangeThread(void* args) {
+    snapshot_range_t* range = (snapshot_range_t*)args;
+
+    // Values are inserted straight from the mapping
+    vector<bulk_op_t> inserts;
+    inserts.reserve(SNAPSHOT_BULK_INSERTS);
+    size_t offset = range->start;
+    while (offset < range->end) {
+        int32_t key;
+        uint32_t length;
+        memcpy(&key, range->data + offset, sizeof(key));
+        memcpy(&length, range->data + offset + sizeof(key), sizeof(length));
+        offset += sizeof(key) + sizeof(length);
+
+        // Value initialized, so the fields not set here start empty
+        inserts.emplace_back();
+        bulk_op_t* insert = &inserts.back();
+        insert->type = BULK_INSERT;
+        insert->key = key;
+        insert->value = range->data + offset;
+        insert->length = length;
+        offset += length;
+
+        if (inserts.size() == SNAPSHOT_BULK_INSERTS) {
+            range->map->executeBulk(inserts.data(), inserts.size());
+            inserts.clear();
+        }
+    }
+    range->map->executeBulk(inserts.data(), inserts.size());
+    return nullptr;
+}
+
+bool readSnapshot(string path, ConcurrentMap* map, int numThreads) {
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        cerr << "Error opening snapshot\n";
+        return false;
+    }
+
+    const char* data = file.begin();
+    size_t size = file.size();
+    if (size < SNAPSHOT_HEADER_BYTES || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        cerr << "Error reading snapshot: not a snapshot\n";
+        return false;
+    }
+
+    uint64_t numEntries;
+    memcpy(&numEntries, data + sizeof(SNAPSHOT_MAGIC), sizeof(numEntries));
+
+    // Each thread gets at least a bulk insert's worth of entries
+    if (numThreads < 1) numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t numRanges = min(numEntries / SNAPSHOT_BULK_INSERTS + 1, (uint64_t)numThreads);
+    // Rounded up without adding, since a malformed count can be anything
+    uint64_t entriesPerRange = numEntries / numRanges + 1;
+
+    // Entries vary in length, so only their headers are walked to split them into ranges. The
+    // whole snapshot is checked before anything is inserted. Entries were written a segment at a
+    // time, so each range covers its own run of segments and the threads rarely share a lock.
+    vector<snapshot_range_t> ranges;
+    size_t offset = SNAPSHOT_HEADER_BYTES;
+    uint64_t numRead = 0;
+    for (; numRead < numEntries; numRead++) {
+        if (numRead % entriesPerRange == 0) {
+            if (!ranges.empty()) ranges.back().end = offset;
+            ranges.push_back({map, data, offset, offset});
+        }
+
+        int32_t key;
+        uint32_t length;
+        if (!readEntryHeader(data, size, offset, &key, &length)) break;
+        offset += sizeof(key) + sizeof(length) + length;
+    }
+    // A count past the last entry stops at the end of the file, so the count is checked too
+    if (numRead != numEntries || offset != size) {
+        cerr << "Error reading snapshot: truncated or has trailing bytes\n";
+        return false;
+    }
+    if (!ranges.empty()) ranges.back().end = offset;
+
+    // Keys in a snapshot are distinct, so the ranges can be inserted in any order. The first is
+    // inserted by this thread.
+    vector<pthread_t> threads(ranges.size());
+    vector<bool> started(ranges.size(), false);
+    for (size_t i = 1; i < ranges.size(); i++) {
+        started[i] = pthread_create(&threads[i], nullptr, loadRangeThread, &ranges[i]) == 0;
+        // Inserted by this thread instead, after the first range
+        if (!started[i]) cerr << "Error starting thread\n";
+    }
+    if (!ranges.empty()) loadRangeThread(&ranges[0]);
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (started[i]) {
+            pthread_join(threads[i], nullptr);
+        } else {
+            loadRangeThread(&ranges[i]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+#include "ConcurrentMap.h"
+
+using namespace std;
+
+// A snapshot file starts with SNAPSHOT_MAGIC and an 8 byte count of entries. Each entry follows as
+// a 4 byte key, a 4 byte value length, and the value bytes. Numbers are in the byte order of the
+// machine that wrote the snapshot.
+extern const char SNAPSHOT_MAGIC[8];
+
+// Writes every entry of map to a snapshot at path. Writers may run while it is written, but the
+// snapshot only matches the map if they don't. The snapshot is written next to path and renamed
+// over it once complete, so path holds either the old snapshot or the whole new one. Returns false
+// if the snapshot couldn't be written, leaving path alone.
+bool writeSnapshot(ConcurrentMap* map, string path);
+
+// Inserts every entry of the snapshot at path into map. Keys already in map keep their values.
+// Entries are split into ranges inserted by up to numThreads threads, or one per online CPU if
+// it is 0. Returns false, having inserted nothing, if the snapshot couldn't be read or is
+// malformed.
+bool readSnapshot(string path, ConcurrentMap* map, int numThreads = 0);
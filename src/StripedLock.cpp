@@ -0,0 +1,163 @@
+#include "StripedLock.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <new>
+
+#include "Counters.h"
+#include "Semaphore.h"
+#include "Topology.h"
+
+// Times a spinlock rereads a held lock before giving up the core
+const int SPINS_BEFORE_YIELD = 128;
+
+static_assert(sizeof(stripe_lock_t) == CACHE_LINE_BYTES, "stripe locks must fill one cache line");
+
+// Takes a test-and-test-and-set spinlock. Returns true if it was held.
+bool spinLock(atomic<bool>* locked) {
+    bool contended = false;
+    // Only try to take the lock once it reads free, so waiting threads share the line
+    // instead of bouncing it with writes
+    while (locked->exchange(true, memory_order_acquire)) {
+        contended = true;
+        int spins = 0;
+        while (locked->load(memory_order_relaxed)) {
+            if (++spins == SPINS_BEFORE_YIELD) {
+                spins = 0;
+                sched_yield();
+            } else {
+                cpuRelax();
+            }
+        }
+    }
+    return contended;
+}
+
+StripedLock::StripedLock(int numStripes, lock_strategy_t strategy) {
+    this->numStripes = numStripes;
+    this->strategy = strategy;
+
+    // new doesn't align past 16 bytes before C++17
+    void* memory;
+    while (posix_memalign(&memory, CACHE_LINE_BYTES, numStripes * sizeof(stripe_lock_t)) != 0) {
+        cout << "Error allocating locks\n";
+    }
+    stripes = (stripe_lock_t*)memory;
+
+    for (int i = 0; i < numStripes; i++) {
+        if (strategy == SEMAPHORE_LOCK) {
+            init(&stripes[i].sem, 1);
+        } else if (strategy == SPIN_LOCK || strategy == OPTIMISTIC_LOCK) {
+            new (&stripes[i].spinLocked) atomic<bool>(false);
+        } else {
+            pthread_rwlock_init(&stripes[i].rwlock, nullptr);
+        }
+        new (&stripes[i].version) atomic<unsigned int>(0);
+    }
+}
+
+StripedLock::~StripedLock() {
+    for (int i = 0; i < numStripes; i++) {
+        if (strategy == SEMAPHORE_LOCK) {
+            sem_destroy(&stripes[i].sem);
+        } else if (strategy == RW_LOCK) {
+            pthread_rwlock_destroy(&stripes[i].rwlock);
+        }
+    }
+
+    free(stripes);
+}
+
+int StripedLock::size() { return numStripes; }
+
+void StripedLock::place(int first, int stop, int node) {
+    placeOnNode(&stripes[first], (stop - first) * sizeof(stripe_lock_t), node);
+}
+
+void StripedLock::lock(int stripe) {
+    // Contention is only measured when counting, so it doesn't cost an extra try otherwise
+    bool counting = countersEnabled.load(memory_order_relaxed);
+    bool contended = false;
+
+    if (strategy == SEMAPHORE_LOCK) {
+        if (!counting || sem_trywait(&stripes[stripe].sem) != 0) {
+            contended = counting;
+            wait(&stripes[stripe].sem);
+        }
+    } else if (strategy == SPIN_LOCK) {
+        contended = spinLock(&stripes[stripe].spinLocked);
+    } else if (strategy == OPTIMISTIC_LOCK) {
+        contended = spinLock(&stripes[stripe].spinLocked);
+        // Readers that see the odd version, or any write after it, retry
+        atomic<unsigned int>* version = &stripes[stripe].version;
+        version->store(version->load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    } else if (!counting || pthread_rwlock_trywrlock(&stripes[stripe].rwlock) != 0) {
+        contended = counting;
+        pthread_rwlock_wrlock(&stripes[stripe].rwlock);
+    }
+
+    if (counting) {
+        addCounter(BUCKET_LOCKS, 1);
+        if (contended) addCounter(BUCKET_LOCKS_CONTENDED, 1);
+    }
+}
+
+void StripedLock::unlock(int stripe) {
+    if (strategy == SEMAPHORE_LOCK) {
+        post(&stripes[stripe].sem);
+    } else if (strategy == SPIN_LOCK) {
+        stripes[stripe].spinLocked.store(false, memory_order_release);
+    } else if (strategy == OPTIMISTIC_LOCK) {
+        atomic<unsigned int>* version = &stripes[stripe].version;
+        version->store(version->load(memory_order_relaxed) + 1, memory_order_release);
+        stripes[stripe].spinLocked.store(false, memory_order_release);
+    } else {
+        pthread_rwlock_unlock(&stripes[stripe].rwlock);
+    }
+}
+
+void StripedLock::lockShared(int stripe) {
+    if (strategy != RW_LOCK) {
+        lock(stripe);
+        return;
+    }
+
+    bool counting = countersEnabled.load(memory_order_relaxed);
+    bool contended = false;
+    if (!counting || pthread_rwlock_tryrdlock(&stripes[stripe].rwlock) != 0) {
+        contended = counting;
+        pthread_rwlock_rdlock(&stripes[stripe].rwlock);
+    }
+
+    if (counting) {
+        addCounter(BUCKET_LOCKS, 1);
+        if (contended) addCounter(BUCKET_LOCKS_CONTENDED, 1);
+    }
+}
+
+void StripedLock::unlockShared(int stripe) {
+    if (strategy == RW_LOCK) {
+        pthread_rwlock_unlock(&stripes[stripe].rwlock);
+    } else {
+        unlock(stripe);
+    }
+}
+
+unsigned int StripedLock::readBegin(int stripe) {
+    atomic<unsigned int>* version = &stripes[stripe].version;
+    unsigned int start = version->load(memory_order_acquire);
+    while (start % 2 == 1) {
+        sched_yield();
+        start = version->load(memory_order_acquire);
+    }
+    return start;
+}
+
+bool StripedLock::readValidate(int stripe, unsigned int version) {
+    // Keeps the reads of the stripe from moving after the version check
+    atomic_thread_fence(memory_order_acquire);
+    return stripes[stripe].version.load(memory_order_relaxed) == version;
+}
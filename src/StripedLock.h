@@ -0,0 +1,73 @@
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <atomic>
+
+using namespace std;
+
+enum lock_strategy_t {
+    // POSIX semaphore, the original lock
+    SEMAPHORE_LOCK,
+    // Test-and-test-and-set spinlock
+    SPIN_LOCK,
+    // Reader-writer lock so lookups can run alongside each other
+    RW_LOCK,
+    // Spinlock for writers, while lookups read without locking and retry if a writer ran
+    OPTIMISTIC_LOCK,
+};
+
+const int CACHE_LINE_BYTES = 64;
+
+// One stripe's lock, alone on its cache line so threads locking neighboring stripes don't
+// invalidate each other's lines
+struct alignas(CACHE_LINE_BYTES) stripe_lock_t {
+    union {
+        sem_t sem;
+
+        atomic<bool> spinLocked;
+
+        pthread_rwlock_t rwlock;
+    };
+
+    // Odd while a writer holds an optimistic stripe
+    atomic<unsigned int> version;
+};
+
+// Fixed number of locks shared by any number of buckets
+class StripedLock {
+  private:
+    lock_strategy_t strategy;
+
+    int numStripes;
+
+    stripe_lock_t* stripes;
+
+  public:
+    StripedLock(int numStripes, lock_strategy_t strategy = SEMAPHORE_LOCK);
+
+    ~StripedLock();
+
+    int size();
+
+    // Keeps the stripes from first up to stop on a NUMA node, as far as they fill whole pages
+    void place(int first, int stop, int node);
+
+    void lock(int stripe);
+
+    void unlock(int stripe);
+
+    // Only a reader-writer lock lets shared holders run together, other strategies lock the
+    // stripe exclusively
+    void lockShared(int stripe);
+
+    void unlockShared(int stripe);
+
+    // Starts an optimistic read of the stripe and returns the version to validate it with.
+    // Waits while a writer holds the stripe.
+    unsigned int readBegin(int stripe);
+
+    // Returns true if no writer held the stripe since readBegin returned version
+    bool readValidate(int stripe, unsigned int version);
+};
@@ -0,0 +1,96 @@
+#include "Topology.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Reads a cpulist like 0-3,8,10-11
+vector<int> parseCpuList(const string& list) {
+    vector<int> cpus;
+    stringstream ranges(list);
+    string range;
+    while (getline(ranges, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+vector<numa_node_t> readNumaNodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+    }
+
+    vector<numa_node_t> nodes;
+    DIR* nodeDir = opendir("/sys/devices/system/node");
+    if (nodeDir != nullptr) {
+        for (dirent* entry = readdir(nodeDir); entry != nullptr; entry = readdir(nodeDir)) {
+            string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != string::npos) {
+                continue;
+            }
+
+            numa_node_t node;
+            node.id = atoi(name.c_str() + 4);
+            string cpuList;
+            ifstream cpuListFile("/sys/devices/system/node/" + name + "/cpulist");
+            getline(cpuListFile, cpuList);
+            for (int cpu : parseCpuList(cpuList)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+            }
+            if (!node.cpus.empty()) nodes.push_back(node);
+        }
+        closedir(nodeDir);
+    }
+
+    if (nodes.empty()) {
+        numa_node_t node;
+        node.id = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+        }
+        nodes.push_back(node);
+    }
+
+    // Directory order isn't sorted
+    sort(nodes.begin(), nodes.end(),
+         [](const numa_node_t& a, const numa_node_t& b) { return a.id < b.id; });
+    return nodes;
+}
+
+bool pinThread(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+bool placeOnNode(void* memory, size_t bytes, int node) {
+    uintptr_t pageBytes = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)memory + pageBytes - 1) / pageBytes * pageBytes;
+    uintptr_t stop = ((uintptr_t)memory + bytes) / pageBytes * pageBytes;
+    if (stop <= start) return true;
+
+    // Called through syscall so libnuma isn't needed
+    const int maskBits = 64;
+    if (node >= maskBits) return false;
+    unsigned long nodeMask = 1UL << node;
+    return syscall(SYS_mbind, start, stop - start, MPOL_PREFERRED, &nodeMask, maskBits + 1,
+                   MPOL_MF_MOVE) == 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+// NUMA layout read from sysfs, so it needs no library and works on single node machines
+
+struct numa_node_t {
+    int id;
+
+    // CPUs of the node that this process may run on
+    vector<int> cpus;
+};
+
+// Returns the nodes that have CPUs this process may run on. A machine without NUMA, or without
+// sysfs, is one node holding every allowed CPU.
+vector<numa_node_t> readNumaNodes();
+
+// Pins the calling thread to cpu. Returns false if it isn't allowed to run there.
+bool pinThread(int cpu);
+
+// Asks the kernel to keep the whole pages in bytes of memory on node, moving any that were already
+// touched elsewhere. Returns false if the kernel doesn't support it.
+bool placeOnNode(void* memory, size_t bytes, int node);
@@ -0,0 +1,86 @@
+#include "ValueArena.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "Epoch.h"
+
+// Chunks start small since a map may hold few values, and double up to the largest size
+const size_t MIN_CHUNK_BYTES = 256;
+const size_t MAX_CHUNK_BYTES = 64 * 1024;
+
+ValueArena::ValueArena() {
+    chunks = nullptr;
+    nextChunkBytes = MIN_CHUNK_BYTES;
+    allocatedBytes = 0;
+    deferFrees = false;
+}
+
+ValueArena::~ValueArena() {
+    // Every chunk is released at once without visiting the values
+    while (chunks != nullptr) {
+        arena_chunk_t* next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+}
+
+void ValueArena::freeChunk(arena_chunk_t* chunk) {
+    if (chunk->prev != nullptr) chunk->prev->next = chunk->next;
+    if (chunk->next != nullptr) chunk->next->prev = chunk->prev;
+    if (chunks == chunk) chunks = chunk->next;
+    allocatedBytes -= sizeof(arena_chunk_t) + chunk->capacity;
+
+    if (deferFrees) {
+        epochRetire(chunk, free);
+    } else {
+        free(chunk);
+    }
+}
+
+const char* ValueArena::store(const char* value, size_t length, arena_chunk_t** chunk) {
+    if (length == 0) {
+        *chunk = nullptr;
+        return "";
+    }
+
+    arena_chunk_t* current = chunks;
+    if (current == nullptr || current->capacity - current->used < length) {
+        // The chunk being replaced was kept only because it was newest
+        if (current != nullptr && current->liveBytes == 0) freeChunk(current);
+
+        // A value too big for a whole chunk gets a chunk of its own
+        size_t capacity = length > nextChunkBytes ? length : nextChunkBytes;
+        if (nextChunkBytes < MAX_CHUNK_BYTES) nextChunkBytes *= 2;
+
+        current = (arena_chunk_t*)malloc(sizeof(arena_chunk_t) + capacity);
+        allocatedBytes += sizeof(arena_chunk_t) + capacity;
+        current->prev = nullptr;
+        current->next = chunks;
+        current->capacity = capacity;
+        current->used = 0;
+        current->liveBytes = 0;
+        if (chunks != nullptr) chunks->prev = current;
+        chunks = current;
+    }
+
+    char* copy = (char*)(current + 1) + current->used;
+    memcpy(copy, value, length);
+    current->used += length;
+    current->liveBytes += length;
+
+    *chunk = current;
+    return copy;
+}
+
+void ValueArena::release(arena_chunk_t* chunk, size_t length) {
+    if (chunk == nullptr) return;
+
+    chunk->liveBytes -= length;
+    // The newest chunk keeps taking values, so it stays until it is replaced
+    if (chunk->liveBytes == 0 && chunk != chunks) freeChunk(chunk);
+}
+
+void ValueArena::setDeferFrees(bool deferFrees) { this->deferFrees = deferFrees; }
+
+size_t ValueArena::memoryBytes() { return allocatedBytes; }
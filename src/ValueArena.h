@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+// Block of value bytes, followed by its data
+struct arena_chunk_t {
+    arena_chunk_t* prev;
+
+    arena_chunk_t* next;
+
+    size_t capacity;
+
+    size_t used;
+
+    // Bytes of values stored in the chunk that haven't been released
+    size_t liveBytes;
+};
+
+// Single-owner store for value bytes. Values are appended to the newest chunk, and a chunk is
+// freed once every value in it has been released, or when the arena is destroyed.
+class ValueArena {
+  private:
+    // Newest chunk first
+    arena_chunk_t* chunks;
+
+    size_t nextChunkBytes;
+
+    // Bytes of every chunk still allocated, headers included
+    size_t allocatedBytes;
+
+    // Whether emptied chunks are retired to the epoch reclaimer instead of being freed
+    bool deferFrees;
+
+    void freeChunk(arena_chunk_t* chunk);
+
+  public:
+    ValueArena();
+
+    ~ValueArena();
+
+    // Copies length bytes of value into the arena. Returns the copy and sets chunk to the chunk
+    // to release it from, which is nullptr for an empty value.
+    const char* store(const char* value, size_t length, arena_chunk_t** chunk);
+
+    void release(arena_chunk_t* chunk, size_t length);
+
+    void setDeferFrees(bool deferFrees);
+
+    size_t memoryBytes();
+};
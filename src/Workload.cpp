@@ -0,0 +1,111 @@
+#include "Workload.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <sstream>
+
+// Value inserted by every generated insert
+const char GENERATED_VALUE[] = "asdf";
+
+workload_t defaultWorkload() {
+    workload_t workload;
+    workload.distribution = UNIFORM_KEYS;
+    workload.numKeys = 1000;
+    workload.zipfSkew = 0.99;
+    workload.numBuckets = 1000;
+    workload.hashPolicy = MIX_HASH;
+    workload.insertPercent = 34;
+    workload.lookupPercent = 33;
+    workload.seed = 1;
+    return workload;
+}
+
+// Bits that pick a segment, or the bits that tell apart the keys, of single bucket keys
+int bitsFor(int count) {
+    int bits = 0;
+    while (bits < 31 && (1 << bits) < count) bits++;
+    return bits;
+}
+
+bool workloadFits(workload_t* workload) {
+    if (workload->distribution != SINGLE_BUCKET_KEYS) return true;
+    if (workload->hashPolicy == MODULO_HASH) {
+        // Multiplied as 64 bits, so the largest key is checked before it can overflow
+        return (int64_t)(workload->numKeys - 1) * workload->numBuckets + 1 <= INT_MAX;
+    }
+    return bitsFor(workload->numBuckets) + bitsFor(workload->numKeys) <= 32;
+}
+
+// Returns the index-th key of a single bucket workload
+int singleBucketKey(workload_t* workload, int index) {
+    if (workload->hashPolicy == MODULO_HASH) return index * workload->numBuckets + 1;
+
+    // The top bits of the hash pick the segment and the low bits the bucket within it, so keys
+    // whose hashes only differ in the bits between share both until the segment's table grows
+    // past 2^lowBits buckets. With few enough keys and buckets, it never does.
+    int lowBits = 32 - bitsFor(workload->numBuckets) - bitsFor(workload->numKeys);
+    return unmixHash((uint64_t)index << lowBits);
+}
+
+vector<operation_t> generateOperations(workload_t workload, int numOpps) {
+    mt19937 randGen(workload.seed);
+    uniform_int_distribution<int> uniformKey(0, workload.numKeys - 1);
+    uniform_int_distribution<int> percent(0, 99);
+
+    // Cumulative weight of each key rank, searched with a uniform draw
+    vector<double> zipfCdf;
+    if (workload.distribution == ZIPF_KEYS) {
+        zipfCdf.resize(workload.numKeys);
+        double total = 0;
+        for (int rank = 0; rank < workload.numKeys; rank++) {
+            total += 1 / pow(rank + 1, workload.zipfSkew);
+            zipfCdf[rank] = total;
+        }
+    }
+    uniform_real_distribution<double> zipfDraw(0, zipfCdf.empty() ? 1 : zipfCdf.back());
+
+    vector<operation_t> opps(numOpps);
+    for (operation_t& opp : opps) {
+        int key;
+        if (workload.distribution == ZIPF_KEYS) {
+            key = lower_bound(zipfCdf.begin(), zipfCdf.end(), zipfDraw(randGen)) - zipfCdf.begin();
+            key = min(key, workload.numKeys - 1);
+        } else {
+            key = uniformKey(randGen);
+        }
+        if (workload.distribution == SINGLE_BUCKET_KEYS) key = singleBucketKey(&workload, key);
+        opp.key = key;
+
+        int draw = percent(randGen);
+        if (draw < workload.insertPercent) {
+            opp.type = INSERT;
+            opp.value = GENERATED_VALUE;
+            opp.valueLength = sizeof(GENERATED_VALUE) - 1;
+        } else {
+            opp.type = draw < workload.insertPercent + workload.lookupPercent ? LOOKUP : DELETE;
+            opp.value = nullptr;
+            opp.valueLength = 0;
+        }
+    }
+    return opps;
+}
+
+string formatInstructions(vector<operation_t>* opps, int numThreads) {
+    stringstream instructions;
+    instructions << "N " << numThreads << "\n";
+
+    for (operation_t& opp : *opps) {
+        if (opp.type == INSERT) {
+            instructions << "I " << opp.key << " \"" << string(opp.value, opp.valueLength)
+                         << "\"\n";
+        } else if (opp.type == LOOKUP) {
+            instructions << "L " << opp.key << "\n";
+        } else if (opp.type == DELETE) {
+            instructions << "D " << opp.key << "\n";
+        }
+    }
+    return instructions.str();
+}
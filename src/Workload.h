@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Hash.h"
+#include "Operation.h"
+
+using namespace std;
+
+enum key_distribution_t {
+    // Every key is equally likely
+    UNIFORM_KEYS,
+    // A few keys take most operations
+    ZIPF_KEYS,
+    // Every key lands in the same segment of a map with numBuckets buckets and hashPolicy. Under
+    // MIX_HASH they also share a bucket within the segment, unless there are too many to fit.
+    SINGLE_BUCKET_KEYS,
+};
+
+struct workload_t {
+    key_distribution_t distribution;
+
+    // Distinct keys operations are spread over
+    int numKeys;
+
+    // Zipf exponent, higher is more skewed
+    double zipfSkew;
+
+    // Bucket count and hash of the map, which single bucket keys collide under
+    int numBuckets;
+
+    hash_policy_t hashPolicy;
+
+    // Chance of each operation type in percent. Deletes are whatever remains.
+    int insertPercent;
+
+    int lookupPercent;
+
+    unsigned int seed;
+};
+
+// Returns a workload of uniform keys with the original benchmark's even mix
+workload_t defaultWorkload();
+
+// Returns false if the workload's single bucket keys can't all be told apart as ints, or overflow
+// an int under MODULO_HASH. Other workloads always fit.
+bool workloadFits(workload_t* workload);
+
+// Generates numOpps operations. The same workload always generates the same operations.
+// Insert values point into static storage.
+vector<operation_t> generateOperations(workload_t workload, int numOpps);
+
+// Formats operations as an instruction file for numThreads threads
+string formatInstructions(vector<operation_t>* opps, int numThreads);